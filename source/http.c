@@ -6,32 +6,209 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/net.h>
-#include <linux/printk.h>
 #include <linux/slab.h>
 #include <linux/socket.h>
+#include <linux/spinlock.h>
 #include <linux/stdarg.h>
 #include <linux/string.h>
 #include <linux/types.h>
 #include <linux/uio.h>
 
-const char* SERVER_IP = "127.0.0.1";
-const int SERVER_PORT = 5005;
+#include "vtfs_stats.h"
+#include "vtfs_trace.h"
+
+// set by vtfs_http_configure before the first call
+struct vtfs_http_endpoint {
+  struct sockaddr_in addr;
+  char host[32];                            // for the Host header
+  char token[VTFS_HTTP_TOKEN_MAX * 3 + 1];  // url encoded
+  bool keep_alive;                          // the pool takes connections back
+  // bumped when the server changes, pooled connections to the old one are dropped
+  unsigned int generation;
+};
+
+struct vtfs_http_client {
+  // guards the endpoint and the pool; calls take a copy of the endpoint and don't hold it
+  spinlock_t lock;
+  struct vtfs_http_endpoint endpoint;
+  struct vtfs_stats __percpu* stats;  // the mount's, every phase of a call is counted there
+  unsigned int pool_size;
+  unsigned int pool_nr;
+  struct socket* pool[VTFS_HTTP_POOL_MAX];
+};
+
+static void vtfs_http_release(struct socket* sock) {
+  kernel_sock_shutdown(sock, SHUT_RDWR);
+  sock_release(sock);
+}
+
+// closes the idle connections past keep, sock_release may sleep so they go outside the lock
+static void vtfs_http_trim_pool(struct vtfs_http_client* client, unsigned int keep) {
+  struct socket* drop[VTFS_HTTP_POOL_MAX];
+  unsigned int nr = 0;
+
+  spin_lock(&client->lock);
+  while (client->pool_nr > keep) {
+    drop[nr++] = client->pool[--client->pool_nr];
+  }
+  spin_unlock(&client->lock);
+
+  for (unsigned int i = 0; i < nr; i++) {
+    vtfs_http_release(drop[i]);
+  }
+}
+
+struct vtfs_http_client* vtfs_http_client_alloc(struct vtfs_stats __percpu* stats) {
+  struct vtfs_http_client* client = kzalloc(sizeof(*client), GFP_KERNEL);
+  if (client) {
+    spin_lock_init(&client->lock);
+    client->stats = stats;
+  }
+  return client;
+}
+
+void vtfs_http_client_free(struct vtfs_http_client* client) {
+  if (client) {
+    vtfs_http_trim_pool(client, 0);
+    kfree(client);
+  }
+}
 
-// callee should call free_request on received buffer
-int fill_request(
-    struct kvec* vec, const char* token, const char* method, size_t arg_size, va_list args
+int vtfs_http_configure(
+    struct vtfs_http_client* client, const char* server, const char* token, int pool_size
 ) {
-  // 2048 bytes for URL and 64 bytes for anything else
-  char* request_buffer = kzalloc(2048 + 64, GFP_KERNEL);
+  struct vtfs_http_endpoint* ep = &client->endpoint;
+  struct sockaddr_in addr = {.sin_family = AF_INET};
+  const char* end;
+  u16 port = VTFS_HTTP_DEFAULT_PORT;
+  char enc[sizeof(ep->token)];
+
+  if (pool_size > VTFS_HTTP_POOL_MAX) {
+    return -EINVAL;
+  }
+  if (server) {
+    if (!in4_pton(server, -1, (u8*)&addr.sin_addr.s_addr, ':', &end)) {
+      return -EINVAL;
+    }
+    if (*end == ':' && kstrtou16(end + 1, 10, &port)) {
+      return -EINVAL;
+    }
+    addr.sin_port = htons(port);
+  }
+  if (token) {
+    if (strlen(token) > VTFS_HTTP_TOKEN_MAX) {
+      return -EINVAL;
+    }
+    encode(token, enc);
+  }
+
+  spin_lock(&client->lock);
+  bool moved = server && (addr.sin_addr.s_addr != ep->addr.sin_addr.s_addr ||
+                          addr.sin_port != ep->addr.sin_port);
+  if (moved) {
+    ep->addr = addr;
+    snprintf(ep->host, sizeof(ep->host), "%pI4:%u", &addr.sin_addr, port);
+    ep->generation++;
+  }
+  if (token) {
+    strscpy(ep->token, enc, sizeof(ep->token));
+  }
+  if (pool_size >= 0) {
+    client->pool_size = pool_size;
+    ep->keep_alive = pool_size > 0;
+  }
+  unsigned int keep = moved ? 0 : client->pool_size;
+  spin_unlock(&client->lock);
+
+  // connections to the old server, or more than the pool keeps now
+  vtfs_http_trim_pool(client, keep);
+  return 0;
+}
+
+// an idle connection from the pool if there is one, *reused tells the caller that a failure
+// may only mean the server closed it while it sat there
+static int vtfs_http_connect(
+    struct vtfs_http_client* client,
+    const struct vtfs_http_endpoint* ep,
+    struct socket** sockp,
+    bool* reused
+) {
+  struct socket* sock = NULL;
+
+  spin_lock(&client->lock);
+  if (client->pool_nr && ep->generation == client->endpoint.generation) {
+    sock = client->pool[--client->pool_nr];
+  }
+  spin_unlock(&client->lock);
+
+  *reused = sock != NULL;
+  if (sock) {
+    vtfs_stat_add(client->stats, VTFS_CNT_HTTP_POOL_HITS, 1);
+    *sockp = sock;
+    return 0;
+  }
+
+  u64 start = ktime_get_ns();
+  int error = sock_create_kern(&init_net, AF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
+  if (error < 0) {
+    vtfs_stat_op(client->stats, VTFS_OP_HTTP_CONNECT, start, error);
+    return error;
+  }
+
+  struct sockaddr_in addr = ep->addr;
+  error = kernel_connect(sock, (struct sockaddr*)&addr, sizeof(addr), 0);
+  vtfs_stat_op(client->stats, VTFS_OP_HTTP_CONNECT, start, error);
+  if (error != 0) {
+    sock_release(sock);
+    return error;  // -ECONNREFUSED, -ETIMEDOUT, ..., never mistaken for a missing file
+  }
+
+  *sockp = sock;
+  return 0;
+}
+
+// hands a connection whose response was read to the end back to the pool
+static void vtfs_http_put(
+    struct vtfs_http_client* client,
+    const struct vtfs_http_endpoint* ep,
+    struct socket* sock,
+    bool reusable
+) {
+  if (reusable && ep->keep_alive) {
+    spin_lock(&client->lock);
+    if (ep->generation == client->endpoint.generation && client->pool_nr < client->pool_size) {
+      client->pool[client->pool_nr++] = sock;
+      sock = NULL;
+    }
+    spin_unlock(&client->lock);
+  }
+  if (sock) {
+    vtfs_http_release(sock);
+  }
+}
+
+// the caller frees vec->iov_base; body_len is only sent for POST
+static int fill_request(
+    struct kvec* vec,
+    const struct vtfs_http_endpoint* ep,
+    const char* verb,
+    const char* method,
+    const size_t* body_len,
+    size_t arg_size,
+    va_list args
+) {
+  // 2048 bytes for URL and 256 bytes for the token and anything else
+  char* request_buffer = kzalloc(2048 + 256 + sizeof(ep->token), GFP_KERNEL);
   if (request_buffer == 0) {
     return -ENOMEM;
   }
 
-  strcpy(request_buffer, "GET /");
+  strcpy(request_buffer, verb);
+  strcat(request_buffer, " /");
   strcat(request_buffer, method);
 
   strcat(request_buffer, "?token=");
-  strcat(request_buffer, token);
+  strcat(request_buffer, ep->token);
 
   for (int i = 0; i < arg_size; i++) {
     strcat(request_buffer, "&");
@@ -40,9 +217,17 @@ int fill_request(
     strcat(request_buffer, va_arg(args, char*));
   }
 
-  strcat(request_buffer, " HTTP/1.1\r\nHost:");
-  strcat(request_buffer, SERVER_IP);
-  strcat(request_buffer, "\r\nConnection: close\r\n\r\n");
+  strcat(request_buffer, " HTTP/1.1\r\nHost: ");
+  strcat(request_buffer, ep->host);
+  if (body_len) {
+    char len_buf[32];
+    snprintf(len_buf, sizeof(len_buf), "%zu", *body_len);
+    strcat(request_buffer, "\r\nContent-Type: application/octet-stream\r\n");
+    strcat(request_buffer, "Content-Length: ");
+    strcat(request_buffer, len_buf);
+  }
+  strcat(request_buffer, ep->keep_alive ? "\r\nConnection: keep-alive\r\n\r\n"
+                                        : "\r\nConnection: close\r\n\r\n");
 
   memset(vec, 0, sizeof(struct kvec));
   vec->iov_base = request_buffer;
@@ -51,11 +236,31 @@ int fill_request(
   return 0;
 }
 
-int receive_all(struct socket* sock, char* buffer, size_t buffer_size) {
+// the length of the whole response once its headers are in, 0 before that or when the server
+// didn't say and closes the connection at the end
+static size_t http_message_len(const char* buffer, size_t len) {
+  const char* end = strnstr(buffer, "\r\n\r\n", len);
+  if (end == 0) {
+    return 0;
+  }
+  size_t header_len = end + 4 - buffer;
+
+  const char* header = strnstr(buffer, "\r\nContent-Length: ", header_len);
+  int content_length;
+  if (header == 0 || sscanf(header + 18, "%d", &content_length) != 1 || content_length < 0) {
+    return 0;
+  }
+  return header_len + content_length;
+}
+
+// reads until the response is complete or the server closes the connection, *complete tells
+// whether the connection can carry another request
+int receive_all(struct socket* sock, char* buffer, size_t buffer_size, bool* complete) {
   struct msghdr hdr;
   struct kvec vec;
 
   int read = 0;
+  *complete = false;
 
   while (read < buffer_size) {
     memset(&hdr, 0, sizeof(struct msghdr));
@@ -66,30 +271,45 @@ int receive_all(struct socket* sock, char* buffer, size_t buffer_size) {
     if (ret == 0) {
       break;
     } else if (ret < 0) {
-      return -4;
+      return ret;
     }
     read += ret;
+
+    size_t len = http_message_len(buffer, read);
+    if (len && read >= len) {
+      *complete = read == len;
+      break;
+    }
   }
 
   return read;
 }
 
 int64_t parse_http_response(
-    char* raw_response, size_t raw_response_size, char* response, size_t response_size
+    char* raw_response,
+    size_t raw_response_size,
+    char* response,
+    size_t response_size,
+    size_t* payload_len
 ) {
   char* buffer = raw_response;
 
   // Read Response Line
+  char* status_code;
   {
     char* status_line = strsep(&buffer, "\r");
     strsep(&status_line, " ");
     if (status_line == 0) {
-      return -6;
+      return -EPROTO;
     }
-    char* status_code = strsep(&status_line, " ");
-    printk(KERN_INFO "Received response with status code %s\n", status_code);
+    status_code = strsep(&status_line, " ");
     if (strcmp(status_code, "200") != 0) {
-      return -5;
+      trace_vtfs_http_response(status_code, -1);
+      // a server that doesn't know the method; any other status is a failure of the call
+      if (!strcmp(status_code, "404") || !strcmp(status_code, "501")) {
+        return -EOPNOTSUPP;
+      }
+      return -EIO;
     }
   }
 
@@ -97,7 +317,7 @@ int64_t parse_http_response(
 
   while (true) {
     if (buffer == 0) {
-      return -6;
+      return -EPROTO;
     }
     char* header = strsep(&buffer, "\r");
     ++header;  // skip \n
@@ -109,23 +329,23 @@ int64_t parse_http_response(
     if (strncmp(header, "Content-Length: ", 16) == 0) {
       int error = kstrtoint(header + 16, 0, &length);
       if (error != 0) {
-        return -6;
+        return -EPROTO;
       }
-      printk(KERN_INFO "Received response with content length %d\n", length);
     }
   }
+  trace_vtfs_http_response(status_code, length);
   ++buffer;  // skip last '\n'
 
   if (length == -1) {
-    return -6;
+    return -EPROTO;
   }
 
   if (buffer + length > raw_response + raw_response_size) {
-    return -6;
+    return -EPROTO;
   }
 
   if (length < sizeof(int64_t)) {
-    return -7;
+    return -EPROTO;
   }
 
   length -= sizeof(int64_t);
@@ -139,85 +359,128 @@ int64_t parse_http_response(
 
   buffer += sizeof(int64_t);
   memcpy(response, buffer, length);
+  if (payload_len) {
+    *payload_len = length;
+  }
 
   return return_value;
 }
 
-int64_t vtfs_http_call(
-    const char* token,
+// body is NULL for a GET
+static int64_t vtfs_http_vcall(
+    struct vtfs_http_client* client,
     const char* method,
+    const void* body,
+    size_t body_len,
     char* response_buffer,
     size_t buffer_size,
+    size_t* payload_len,
     size_t arg_size,
-    ...
+    va_list args
 ) {
-  struct socket* sock;
-  int64_t error;
-
-  error = sock_create_kern(&init_net, AF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
-  if (error < 0) {
-    return -1;
-  }
-
-  struct sockaddr_in s_addr = {
-      .sin_family = AF_INET,
-      .sin_addr = {.s_addr = in_aton(SERVER_IP)},
-      .sin_port = htons(SERVER_PORT)
-  };
-
-  error = kernel_connect(sock, (struct sockaddr*)&s_addr, sizeof(struct sockaddr_in), 0);
+  struct vtfs_http_endpoint ep;
+  spin_lock(&client->lock);
+  ep = client->endpoint;
+  spin_unlock(&client->lock);
+
+  struct kvec vecs[2];
+  int64_t error = fill_request(
+      &vecs[0], &ep, body ? "POST" : "GET", method, body ? &body_len : NULL, arg_size, args
+  );
   if (error != 0) {
-    sock_release(sock);
-    return -2;
-  }
-
-  struct kvec kvec;
-  va_list args;
-  va_start(args, arg_size);
-  error = fill_request(&kvec, token, method, arg_size, args);
-  va_end(args);
-
-  if (error != 0) {
-    kernel_sock_shutdown(sock, SHUT_RDWR);
-    sock_release(sock);
     return error;
   }
-
-  struct msghdr msg;
-  memset(&msg, 0, sizeof(struct msghdr));
-
-  error = kernel_sendmsg(sock, &msg, &kvec, 1, kvec.iov_len);
-  kfree(kvec.iov_base);
-
-  if (error < 0) {
-    kernel_sock_shutdown(sock, SHUT_RDWR);
-    sock_release(sock);
-    return -3;
-  }
+  vecs[1].iov_base = (void*)body;
+  vecs[1].iov_len = body_len;
+  size_t nr_vecs = body ? 2 : 1;
+  size_t request_len = vecs[0].iov_len + (body ? body_len : 0);
 
   size_t raw_buffer_size = buffer_size + 1024;  // add 1KB for HTTP headers
   char* raw_response_buffer = kmalloc(raw_buffer_size, GFP_KERNEL);
   if (raw_response_buffer == 0) {
-    kernel_sock_shutdown(sock, SHUT_RDWR);
-    sock_release(sock);
+    kfree(vecs[0].iov_base);
     return -ENOMEM;
   }
-  int read_bytes = receive_all(sock, raw_response_buffer, raw_buffer_size);
 
-  kernel_sock_shutdown(sock, SHUT_RDWR);
-  sock_release(sock);
+  struct socket* sock;
+  bool reused, complete;
+  int read_bytes;
+  while (true) {
+    error = vtfs_http_connect(client, &ep, &sock, &reused);
+    if (error != 0) {
+      goto out;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+
+    u64 start = ktime_get_ns();
+    error = kernel_sendmsg(sock, &msg, vecs, nr_vecs, request_len);
+    vtfs_stat_op(client->stats, VTFS_OP_HTTP_SEND, start, error);
+    if (error < 0) {
+      vtfs_http_release(sock);
+      if (reused) {
+        continue;
+      }
+      goto out;
+    }
+    vtfs_stat_add(client->stats, VTFS_CNT_HTTP_SENT_BYTES, error);
+
+    start = ktime_get_ns();
+    read_bytes = receive_all(sock, raw_response_buffer, raw_buffer_size, &complete);
+    vtfs_stat_op(client->stats, VTFS_OP_HTTP_RECV, start, read_bytes);
+    // an idle connection the server closed answers with nothing, the request never got there
+    if (read_bytes <= 0 && reused) {
+      vtfs_http_release(sock);
+      continue;
+    }
+    break;
+  }
+
+  vtfs_http_put(client, &ep, sock, complete);
 
-  if (read_bytes < 0) {
-    kfree(raw_response_buffer);
-    return -4;
+  if (read_bytes <= 0) {
+    // a new connection the server closed without an answer
+    error = read_bytes ? read_bytes : -ECONNRESET;
+    goto out;
   }
+  vtfs_stat_add(client->stats, VTFS_CNT_HTTP_RECEIVED_BYTES, read_bytes);
 
-  error = parse_http_response(raw_response_buffer, read_bytes, response_buffer, buffer_size);
+  u64 start = ktime_get_ns();
+  error = parse_http_response(
+      raw_response_buffer, read_bytes, response_buffer, buffer_size, payload_len
+  );
+  vtfs_stat_op(client->stats, VTFS_OP_HTTP_PARSE, start, error);
 
+out:
   kfree(raw_response_buffer);
+  kfree(vecs[0].iov_base);
   return error;
 }
 
+int64_t vtfs_http_call(
+    struct vtfs_http_client* client,
+    const char* method,
+    char* response_buffer,
+    size_t buffer_size,
+    size_t* payload_len,
+    size_t arg_size,
+    ...
+) {
+  u64 start = vtfs_trace_start(vtfs_rpc_exit);
+  trace_vtfs_rpc_enter(method, 0);
+
+  va_list args;
+  va_start(args, arg_size);
+  int64_t ret = vtfs_http_vcall(
+      client, method, NULL, 0, response_buffer, buffer_size, payload_len, arg_size, args
+  );
+  va_end(args);
+
+  trace_vtfs_rpc_exit(method, ret, start);
+  return ret;
+}
+
 void encode(const char* src, char* dst) {
   while (*src != '\0') {
     if ((*src >= '0' && *src <= '9') || (*src >= 'a' && *src <= 'z') ||
@@ -234,104 +497,26 @@ void encode(const char* src, char* dst) {
 }
 
 int64_t vtfs_http_call_with_body(
-    const char* token,
+    struct vtfs_http_client* client,
     const char* method,
     const void* body,
     size_t body_len,
     char* response_buffer,
     size_t response_size,
+    size_t* payload_len,
     size_t arg_size,
     ...
 ) {
-  struct socket* sock;
-  int64_t error;
-
-  error = sock_create_kern(&init_net, AF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
-  if (error < 0)
-    return -1;
-
-  struct sockaddr_in s_addr = {
-      .sin_family = AF_INET,
-      .sin_addr = {.s_addr = in_aton(SERVER_IP)},
-      .sin_port = htons(SERVER_PORT),
-  };
-
-  error = kernel_connect(sock, (struct sockaddr*)&s_addr, sizeof(s_addr), 0);
-  if (error) {
-    sock_release(sock);
-    return -2;
-  }
-
-  /* -------- build headers -------- */
-
-  char* hdr = kzalloc(4096, GFP_KERNEL);
-  if (!hdr) {
-    sock_release(sock);
-    return -ENOMEM;
-  }
-
-  strcpy(hdr, "POST /");
-  strcat(hdr, method);
-  strcat(hdr, "?token=");
-  strcat(hdr, token);
+  u64 start = vtfs_trace_start(vtfs_rpc_exit);
+  trace_vtfs_rpc_enter(method, body_len);
 
   va_list args;
   va_start(args, arg_size);
-  for (size_t i = 0; i < arg_size; i++) {
-    strcat(hdr, "&");
-    strcat(hdr, va_arg(args, char*));
-    strcat(hdr, "=");
-    strcat(hdr, va_arg(args, char*));
-  }
+  int64_t ret = vtfs_http_vcall(
+      client, method, body, body_len, response_buffer, response_size, payload_len, arg_size, args
+  );
   va_end(args);
 
-  char len_buf[32];
-  snprintf(len_buf, sizeof(len_buf), "%zu", body_len);
-
-  strcat(hdr, " HTTP/1.1\r\nHost: ");
-  strcat(hdr, SERVER_IP);
-  strcat(hdr, "\r\nContent-Type: application/octet-stream\r\n");
-  strcat(hdr, "Content-Length: ");
-  strcat(hdr, len_buf);
-  strcat(hdr, "\r\nConnection: close\r\n\r\n");
-
-  /* -------- send headers + body -------- */
-
-  struct kvec vecs[2] = {
-      {        .iov_base = hdr, .iov_len = strlen(hdr)},
-      {.iov_base = (void*)body,    .iov_len = body_len},
-  };
-
-  struct msghdr msg = {};
-  error = kernel_sendmsg(sock, &msg, vecs, 2, vecs[0].iov_len + body_len);
-  kfree(hdr);
-
-  if (error < 0) {
-    sock_release(sock);
-    return -3;
-  }
-
-  /* -------- receive response -------- */
-
-  size_t raw_size = response_size + 1024;
-  char* raw = kmalloc(raw_size, GFP_KERNEL);
-  if (!raw) {
-    sock_release(sock);
-    return -ENOMEM;
-  }
-
-  int read_bytes = receive_all(sock, raw, raw_size);
-
-  kernel_sock_shutdown(sock, SHUT_RDWR);
-  sock_release(sock);
-
-  if (read_bytes < 0) {
-    kfree(raw);
-    return -4;
-  }
-
-  error = parse_http_response(raw, read_bytes, response_buffer, response_size);
-  kfree(raw);
-
-  return error;
+  trace_vtfs_rpc_exit(method, ret, start);
+  return ret;
 }
@@ -3,22 +3,50 @@
 
 #include <linux/inet.h>
 
+#define VTFS_HTTP_DEFAULT_PORT 5005
+#define VTFS_HTTP_TOKEN_MAX 128
+// most idle connections kept open for reuse
+#define VTFS_HTTP_POOL_MAX 64
+
+// the endpoint and connection pool of one mount; unusable until configured with a server
+struct vtfs_http_client;
+
+struct vtfs_stats;
+
+// HTTP phase latencies, bytes and pool hits go to stats, which must outlive the client
+struct vtfs_http_client* vtfs_http_client_alloc(struct vtfs_stats __percpu* stats);
+
+// closes the pooled connections, NULL is ignored
+void vtfs_http_client_free(struct vtfs_http_client* client);
+
+// server is "a.b.c.d[:port]", pool_size how many idle connections to keep, 0 closes each one
+// after its request; NULL and -1 keep the current value
+int vtfs_http_configure(
+    struct vtfs_http_client* client, const char* server, const char* token, int pool_size
+);
+
+// returns the server's return value or a negative errno: the socket error when the server
+// can't be reached, -EIO for an error status, -EPROTO for a malformed response and
+// -EOPNOTSUPP if the server answers 404 or 501, i.e. doesn't have the method. *payload_len, if
+// given, is set to how many bytes of response_buffer the server filled.
 int64_t vtfs_http_call(
-    const char* token,
+    struct vtfs_http_client* client,
     const char* method,
     char* response_buffer,
     size_t buffer_size,
+    size_t* payload_len,
     size_t arg_size,
     ...
 );
 
 int64_t vtfs_http_call_with_body(
-    const char* token,
+    struct vtfs_http_client* client,
     const char* method,
     const void* body,
     size_t body_len,
     char* response_buffer,
     size_t response_size,
+    size_t* payload_len,
     size_t arg_size,
     ...
 );
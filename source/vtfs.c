@@ -1,14 +1,32 @@
 #include "vtfs.h"
 
+#include <linux/backing-dev.h>
+#include <linux/bvec.h>
+#include <linux/debugfs.h>
 #include <linux/fs.h>
+#include <linux/fs_context.h>
+#include <linux/fs_parser.h>
+#include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/mm.h>
 #include <linux/mnt_idmapping.h>
 #include <linux/module.h>
+#include <linux/pagemap.h>
+#include <linux/pagevec.h>
 #include <linux/printk.h>
+#include <linux/sched/signal.h>
+#include <linux/splice.h>
+#include <linux/statfs.h>
 #include <linux/string.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/writeback.h>
 
 #include "vtfs_backend.h"
+#include "vtfs_stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "vtfs_trace.h"
 
 #define MODULE_NAME "vtfs"
 MODULE_LICENSE("GPL");
@@ -22,26 +40,118 @@ struct inode_operations vtfs_inode_ops = {
     .mkdir = vtfs_mkdir,
     .rmdir = vtfs_rmdir,
     .link = vtfs_link,
-    .setattr = vtfs_setattr
+    .setattr = vtfs_setattr,
+    .getattr = vtfs_getattr,
 };
 
 struct file_operations vtfs_dir_ops = {
     .iterate_shared = vtfs_iterate,
+    .fsync = vtfs_fsync,
+    .unlocked_ioctl = vtfs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+const struct super_operations vtfs_super_ops = {
+    .alloc_inode = vtfs_alloc_inode,
+    .free_inode = vtfs_free_inode,
+    .statfs = vtfs_statfs,
+    .sync_fs = vtfs_sync_fs,
+    .evict_inode = vtfs_evict_inode,
 };
 
 struct file_operations vtfs_file_ops = {
     .open = vtfs_open,
     .release = vtfs_release,
-    .read = vtfs_read,
-    .write = vtfs_write,
+    .read_iter = vtfs_file_read_iter,
+    .write_iter = vtfs_file_write_iter,
+    .mmap = vtfs_mmap,
+    .splice_read = vtfs_splice_read,
+    .splice_write = iter_file_splice_write,
+    .llseek = vtfs_llseek,
+    .remap_file_range = vtfs_remap_file_range,
+    .copy_file_range = vtfs_copy_file_range,
+    .fsync = vtfs_fsync,
+    .unlocked_ioctl = vtfs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+// only set for remote backends, a local one sees every change to the tree
+const struct dentry_operations vtfs_dentry_ops = {
+    .d_revalidate = vtfs_d_revalidate,
+};
+
+// file data is cached in the page cache and written to the backend by writeback; with
+// VTFS_STORAGE_NOCACHE only mapped files are
+const struct address_space_operations vtfs_aops = {
+    .read_folio = vtfs_read_folio,
+    .readahead = vtfs_readahead,
+    .write_begin = vtfs_write_begin,
+    .write_end = vtfs_write_end,
+    .writepages = vtfs_writepages,
+    .dirty_folio = filemap_dirty_folio,
+    .migrate_folio = filemap_migrate_folio,
+};
+
+// mapped files are served from the page cache, written back like any other dirty page
+static const struct vm_operations_struct vtfs_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = vtfs_page_mkwrite,
+};
+
+// backends put their statistics files here
+struct dentry* vtfs_debugfs_root;
+
+static struct kmem_cache* vtfs_inode_cachep;
+
+// the first one is used when a mount doesn't say
+static const struct vtfs_backend_ops* const vtfs_backends[] = {
+    &vtfs_lavnetfs_backend_ops,
+    &vtfs_ram_backend_ops,
 };
 
+static int vtfs_backends_init(void) {
+  for (int i = 0; i < ARRAY_SIZE(vtfs_backends); i++) {
+    int ret = vtfs_backends[i]->init();
+    if (ret) {
+      LOG("%s backend init failed: %d\n", vtfs_backends[i]->name, ret);
+      while (i--)
+        vtfs_backends[i]->shutdown();
+      return ret;
+    }
+  }
+  return 0;
+}
+
+static void vtfs_backends_shutdown(void) {
+  for (int i = ARRAY_SIZE(vtfs_backends) - 1; i >= 0; i--)
+    vtfs_backends[i]->shutdown();
+}
+
+static void vtfs_inode_init_once(void* obj) {
+  struct vtfs_inode_info* vi = obj;
+  inode_init_once(&vi->vfs_inode);
+}
+
 static int __init vtfs_init(void) {
   int ret;
 
-  ret = vtfs_storage_init();
+  vtfs_inode_cachep = kmem_cache_create(
+      "vtfs_inode_cache",
+      sizeof(struct vtfs_inode_info),
+      0,
+      SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT,
+      vtfs_inode_init_once
+  );
+  if (!vtfs_inode_cachep)
+    return -ENOMEM;
+
+  vtfs_debugfs_root = debugfs_create_dir(MODULE_NAME, NULL);
+
+  ret = vtfs_backends_init();
   if (ret) {
-    LOG("vtfs_storage_init failed: %d\n", ret);
+    debugfs_remove_recursive(vtfs_debugfs_root);
+    kmem_cache_destroy(vtfs_inode_cachep);
     return ret;
   }
 
@@ -49,110 +159,656 @@ static int __init vtfs_init(void) {
   ret = register_filesystem(&vtfs_fs_type);
   if (ret) {
     LOG("Failed to register filesystem: %d\n", ret);
-    vtfs_storage_shutdown();
+    vtfs_backends_shutdown();
+    debugfs_remove_recursive(vtfs_debugfs_root);
+    kmem_cache_destroy(vtfs_inode_cachep);
   }
   return ret;
 }
 
 static void __exit vtfs_exit(void) {
   unregister_filesystem(&vtfs_fs_type);
-  vtfs_storage_shutdown();
+  vtfs_backends_shutdown();
+  debugfs_remove_recursive(vtfs_debugfs_root);
+  // inodes are freed after a grace period
+  rcu_barrier();
+  kmem_cache_destroy(vtfs_inode_cachep);
   LOG("VTFS left the kernel\n");
 }
 
 struct file_system_type vtfs_fs_type = {
     .name = "vtfs",
-    .mount = vtfs_mount,
+    .init_fs_context = vtfs_init_fs_context,
+    .parameters = vtfs_fs_parameters,
     .kill_sb = vtfs_kill_sb,
 };
 
-struct dentry* vtfs_mount(
-    struct file_system_type* fs_type, int flags, const char* token, void* data
-) {
-  struct dentry* ret = mount_nodev(fs_type, flags, data, vtfs_fill_super);
-  if (ret == NULL) {
-    printk(KERN_ERR "Can't mount file system");
+enum {
+  VTFS_OPT_SIZE,
+  VTFS_OPT_NR_INODES,
+  VTFS_OPT_ACREGMIN,
+  VTFS_OPT_ACREGMAX,
+  VTFS_OPT_ACDIRMIN,
+  VTFS_OPT_ACDIRMAX,
+  VTFS_OPT_ACTIMEO,
+  VTFS_OPT_NEGTIMEO,
+  VTFS_OPT_SERVER,
+  VTFS_OPT_TOKEN,
+  VTFS_OPT_RPC_CHUNK,
+  VTFS_OPT_READAHEAD,
+  VTFS_OPT_CONNS,
+  VTFS_OPT_BACKEND,
+  VTFS_OPT_IMAGE,
+  VTFS_OPT_WAL,
+};
+
+// backend is "lavnetfs" or "ram" and stays for the life of the mount. Sizes take a [kKmMgG]
+// suffix, cache lifetimes are in seconds; actimeo sets all four attribute lifetimes. server,
+// token, rpc_chunk and conns configure the transport of a lavnetfs backend mount, each mount has
+// its own. image and wal are absolute paths of the checkpoint image and write-ahead log of a RAM
+// backend mount, fixed once it is mounted
+const struct fs_parameter_spec vtfs_fs_parameters[] = {
+    fsparam_string("size", VTFS_OPT_SIZE),
+    fsparam_string("nr_inodes", VTFS_OPT_NR_INODES),
+    fsparam_u32("acregmin", VTFS_OPT_ACREGMIN),
+    fsparam_u32("acregmax", VTFS_OPT_ACREGMAX),
+    fsparam_u32("acdirmin", VTFS_OPT_ACDIRMIN),
+    fsparam_u32("acdirmax", VTFS_OPT_ACDIRMAX),
+    fsparam_u32("actimeo", VTFS_OPT_ACTIMEO),
+    fsparam_u32("negtimeo", VTFS_OPT_NEGTIMEO),
+    fsparam_string("server", VTFS_OPT_SERVER),
+    fsparam_string("token", VTFS_OPT_TOKEN),
+    fsparam_string("rpc_chunk", VTFS_OPT_RPC_CHUNK),
+    fsparam_string("readahead", VTFS_OPT_READAHEAD),
+    fsparam_u32("conns", VTFS_OPT_CONNS),
+    fsparam_string("backend", VTFS_OPT_BACKEND),
+    fsparam_string("image", VTFS_OPT_IMAGE),
+    fsparam_string("wal", VTFS_OPT_WAL),
+    {}
+};
+
+// cache lifetimes in seconds, the NFS defaults
+#define VTFS_ACREGMIN 3
+#define VTFS_ACREGMAX 60
+#define VTFS_ACDIRMIN 30
+#define VTFS_ACDIRMAX 60
+#define VTFS_NEGTIMEO 30
+
+// options of a mount or remount, applied once they have all been parsed
+struct vtfs_fs_context {
+  const struct vtfs_backend_ops* ops;  // NULL if not given
+  struct vtfs_mount_opts opts;  // for the backend, its strings point at the ones below
+  char* server;
+  char* token;
+  char* image;
+  char* wal;
+  // in jiffies
+  unsigned long acregmin;
+  unsigned long acregmax;
+  unsigned long acdirmin;
+  unsigned long acdirmax;
+  unsigned long negtimeo;
+  unsigned long ra_pages;
+};
+
+static int vtfs_parse_param(struct fs_context* fc, struct fs_parameter* param) {
+  struct vtfs_fs_context* ctx = fc->fs_private;
+  struct fs_parse_result result;
+  char* rest;
+  u64 value;
+
+  int opt = fs_parse(fc, vtfs_fs_parameters, param, &result);
+  if (opt < 0)
+    return opt;
+
+  switch (opt) {
+    case VTFS_OPT_SIZE:
+    case VTFS_OPT_NR_INODES:
+    case VTFS_OPT_RPC_CHUNK:
+    case VTFS_OPT_READAHEAD:
+      value = memparse(param->string, &rest);
+      if (*rest)
+        return invalfc(fc, "bad value for %s: %s", param->key, param->string);
+      if (opt == VTFS_OPT_SIZE)
+        ctx->opts.max_bytes = value;
+      else if (opt == VTFS_OPT_NR_INODES)
+        ctx->opts.max_inodes = value;
+      else if (opt == VTFS_OPT_RPC_CHUNK)
+        ctx->opts.rpc_chunk = value;
+      else
+        ctx->ra_pages = value >> PAGE_SHIFT;
+      break;
+    case VTFS_OPT_ACREGMIN:
+    case VTFS_OPT_ACREGMAX:
+    case VTFS_OPT_ACDIRMIN:
+    case VTFS_OPT_ACDIRMAX:
+    case VTFS_OPT_ACTIMEO:
+    case VTFS_OPT_NEGTIMEO:
+      if (result.uint_32 > INT_MAX / HZ)
+        return invalfc(fc, "%s is too long", param->key);
+      unsigned long ttl = result.uint_32 * HZ;
+      if (opt == VTFS_OPT_ACREGMIN)
+        ctx->acregmin = ttl;
+      else if (opt == VTFS_OPT_ACREGMAX)
+        ctx->acregmax = ttl;
+      else if (opt == VTFS_OPT_ACDIRMIN)
+        ctx->acdirmin = ttl;
+      else if (opt == VTFS_OPT_ACDIRMAX)
+        ctx->acdirmax = ttl;
+      else if (opt == VTFS_OPT_NEGTIMEO)
+        ctx->negtimeo = ttl;
+      else
+        ctx->acregmin = ctx->acregmax = ctx->acdirmin = ctx->acdirmax = ttl;
+      break;
+    case VTFS_OPT_SERVER:
+      kfree(ctx->server);
+      ctx->opts.server = ctx->server = param->string;
+      param->string = NULL;
+      break;
+    case VTFS_OPT_TOKEN:
+      kfree(ctx->token);
+      ctx->opts.token = ctx->token = param->string;
+      param->string = NULL;
+      break;
+    case VTFS_OPT_IMAGE:
+      kfree(ctx->image);
+      ctx->opts.image = ctx->image = param->string;
+      param->string = NULL;
+      break;
+    case VTFS_OPT_WAL:
+      kfree(ctx->wal);
+      ctx->opts.wal = ctx->wal = param->string;
+      param->string = NULL;
+      break;
+    case VTFS_OPT_CONNS:
+      ctx->opts.conns = result.uint_32;
+      break;
+    case VTFS_OPT_BACKEND:
+      ctx->ops = NULL;
+      for (int i = 0; i < ARRAY_SIZE(vtfs_backends); i++) {
+        if (!strcmp(param->string, vtfs_backends[i]->name))
+          ctx->ops = vtfs_backends[i];
+      }
+      if (!ctx->ops)
+        return invalfc(fc, "unknown backend: %s", param->string);
+      break;
+  }
+  return 0;
+}
+
+// the backend has taken ctx->opts already
+static void vtfs_apply_options(struct super_block* sb, const struct vtfs_fs_context* ctx) {
+  struct vtfs_sb_info* sbi = VTFS_SB(sb);
+
+  sbi->acregmin = ctx->acregmin;
+  sbi->acregmax = max(ctx->acregmax, ctx->acregmin);
+  sbi->acdirmin = ctx->acdirmin;
+  sbi->acdirmax = max(ctx->acdirmax, ctx->acdirmin);
+  sbi->negtimeo = ctx->negtimeo;
+  sb->s_bdi->ra_pages = ctx->ra_pages;
+}
+
+static int vtfs_get_tree(struct fs_context* fc) {
+  return get_tree_nodev(fc, vtfs_fill_super);
+}
+
+// remount; options it leaves out keep their values
+static int vtfs_reconfigure(struct fs_context* fc) {
+  struct vtfs_fs_context* ctx = fc->fs_private;
+  struct vtfs_sb_info* sbi = VTFS_SB(fc->root->d_sb);
+
+  if (ctx->ops && ctx->ops != sbi->ops)
+    return invalfc(fc, "the backend of a mount can't change");
+
+  int err = sbi->ops->configure(fc->root->d_sb, &ctx->opts);
+  if (err)
+    return err;
+
+  vtfs_apply_options(fc->root->d_sb, ctx);
+  return 0;
+}
+
+static void vtfs_free_fc(struct fs_context* fc) {
+  struct vtfs_fs_context* ctx = fc->fs_private;
+  if (!ctx)
+    return;
+
+  kfree(ctx->server);
+  kfree(ctx->token);
+  kfree(ctx->image);
+  kfree(ctx->wal);
+  kfree(ctx);
+}
+
+static const struct fs_context_operations vtfs_context_ops = {
+    .parse_param = vtfs_parse_param,
+    .get_tree = vtfs_get_tree,
+    .reconfigure = vtfs_reconfigure,
+    .free = vtfs_free_fc,
+};
+
+int vtfs_init_fs_context(struct fs_context* fc) {
+  struct vtfs_fs_context* ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+  if (!ctx)
+    return -ENOMEM;
+
+  ctx->opts.max_bytes = VTFS_OPT_UNSET;
+  ctx->opts.max_inodes = VTFS_OPT_UNSET;
+  ctx->opts.rpc_chunk = VTFS_OPT_UNSET;
+  ctx->opts.conns = VTFS_OPT_UNSET;
+  if (fc->purpose == FS_CONTEXT_FOR_RECONFIGURE) {
+    struct super_block* sb = fc->root->d_sb;
+    struct vtfs_sb_info* sbi = VTFS_SB(sb);
+    ctx->acregmin = sbi->acregmin;
+    ctx->acregmax = sbi->acregmax;
+    ctx->acdirmin = sbi->acdirmin;
+    ctx->acdirmax = sbi->acdirmax;
+    ctx->negtimeo = sbi->negtimeo;
+    ctx->ra_pages = sb->s_bdi->ra_pages;
   } else {
-    printk(KERN_INFO "Mounted successfully");
+    ctx->acregmin = VTFS_ACREGMIN * HZ;
+    ctx->acregmax = VTFS_ACREGMAX * HZ;
+    ctx->acdirmin = VTFS_ACDIRMIN * HZ;
+    ctx->acdirmax = VTFS_ACDIRMAX * HZ;
+    ctx->negtimeo = VTFS_NEGTIMEO * HZ;
+    ctx->ra_pages = VM_READAHEAD_PAGES;
   }
-  return ret;
+
+  fc->fs_private = ctx;
+  fc->ops = &vtfs_context_ops;
+  return 0;
 }
 
-int vtfs_fill_super(struct super_block* sb, void* data, int silent) {
+int vtfs_fill_super(struct super_block* sb, struct fs_context* fc) {
+  struct vtfs_fs_context* ctx = fc->fs_private;
+
+  // freed by vtfs_kill_sb, also when the mount fails
+  struct vtfs_sb_info* sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+  if (!sbi)
+    return -ENOMEM;
+  sb->s_fs_info = sbi;
+  sbi->ops = ctx->ops ? ctx->ops : vtfs_backends[0];
+  sbi->remote = sbi->ops->flags & VTFS_STORAGE_REMOTE;
+  sbi->stats = vtfs_stats_alloc();
+  if (!sbi->stats)
+    return -ENOMEM;
+
+  char dir_name[32];
+  snprintf(dir_name, sizeof(dir_name), "%u:%u", MAJOR(sb->s_dev), MINOR(sb->s_dev));
+  sbi->debugfs_dir = debugfs_create_dir(dir_name, vtfs_debugfs_root);
+  vtfs_stats_create_file("stats", sbi->debugfs_dir, sbi->stats);
+
+  // the backend's own state, torn down by its kill_sb
+  int err = sbi->ops->fill_super(sb, &ctx->opts);
+  if (err) {
+    return err;
+  }
+
+  // a bdi of our own, the default one of nodev filesystems never writes anything back
+  err = super_setup_bdi(sb);
+  if (err) {
+    return err;
+  }
+  vtfs_apply_options(sb, ctx);
+
+  // s_op before the first inode, alloc_inode only makes a vtfs_inode_info through it
+  sb->s_maxbytes = MAX_LFS_FILESIZE;
+  // clone alignment checks work in units of the block size, which is the backends' page
+  sb->s_blocksize = PAGE_SIZE;
+  sb->s_blocksize_bits = PAGE_SHIFT;
+  sb->s_magic = VTFS_MAGIC;
+  sb->s_op = &vtfs_super_ops;
+  if (sbi->remote)
+    set_default_d_op(sb, &vtfs_dentry_ops);
+
   struct vtfs_node_meta meta;
-  int err = vtfs_storage_get_root(&meta);
+  err = vtfs_stat_call(sbi->stats, VTFS_OP_GET_ROOT, sbi->ops->get_root(sb, &meta));
   if (err) {
     return err;
   }
 
-  struct inode* inode = vtfs_get_inode(sb, NULL, meta.mode, (int)meta.ino);
+  struct inode* inode = vtfs_get_inode(sb, NULL, &meta);
 
   if (!inode)
     return -ENOMEM;
 
   inode->i_op = &vtfs_inode_ops;
   inode->i_fop = &vtfs_dir_ops;
-  inode->i_size = meta.size;
-  set_nlink(inode, meta.nlink);
 
   sb->s_root = d_make_root(inode);
   if (sb->s_root == NULL) {
     iput(inode);
     return -ENOMEM;
   }
-  printk(KERN_INFO "return 0\n");
   return 0;
 }
 
+static unsigned long vtfs_attr_ttl_min(const struct inode* inode) {
+  struct vtfs_sb_info* sbi = VTFS_SB(inode->i_sb);
+  return S_ISDIR(inode->i_mode) ? sbi->acdirmin : sbi->acregmin;
+}
+
+static bool vtfs_attrs_fresh(const struct inode* inode) {
+  const struct vtfs_inode_info* vi = VTFS_I(inode);
+  return !VTFS_SB(inode->i_sb)->remote || time_before(jiffies, vi->attr_time + vi->attr_ttl);
+}
+
+// takes attributes just fetched from a remote backend; the size is left alone while the page
+// cache has data the backend hasn't seen yet
+static void vtfs_update_inode(struct inode* inode, const struct vtfs_node_meta* meta) {
+  struct vtfs_sb_info* sbi = VTFS_SB(inode->i_sb);
+  struct vtfs_inode_info* vi = VTFS_I(inode);
+  bool changed = false;
+
+  if (inode->i_nlink != meta->nlink) {
+    set_nlink(inode, meta->nlink);
+    changed = true;
+  }
+  if (i_size_read(inode) != meta->size &&
+      !mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY)) {
+    i_size_write(inode, meta->size);
+    // written by someone else, what is cached may be stale
+    invalidate_mapping_pages(inode->i_mapping, 0, -1);
+    changed = true;
+  }
+
+  unsigned long max = S_ISDIR(inode->i_mode) ? sbi->acdirmax : sbi->acregmax;
+  unsigned long min = vtfs_attr_ttl_min(inode);
+  vi->attr_ttl = changed ? min : clamp(vi->attr_ttl * 2, min, max);
+  vi->attr_time = jiffies;
+}
+
+// the hottest metadata call, dispatched without an indirect branch
+static int vtfs_backend_lookup(
+    struct super_block* sb, vtfs_ino_t parent, const char* name, struct vtfs_node_meta* out
+) {
+  struct vtfs_sb_info* sbi = VTFS_SB(sb);
+  return vtfs_stat_call(
+      sbi->stats,
+      VTFS_OP_LOOKUP,
+      INDIRECT_CALL_2(
+          sbi->ops->lookup, vtfs_lavnetfs_lookup, vtfs_ram_lookup, sb, parent, name, out
+      )
+  );
+}
+
+// refetches the attributes of the inode behind dentry
+static int vtfs_refresh_inode(struct dentry* dentry) {
+  struct inode* inode = d_inode(dentry);
+  struct vtfs_node_meta meta;
+  int err;
+
+  struct vtfs_sb_info* sbi = VTFS_SB(inode->i_sb);
+  if (IS_ROOT(dentry)) {
+    err = vtfs_stat_call(sbi->stats, VTFS_OP_GET_ROOT, sbi->ops->get_root(inode->i_sb, &meta));
+  } else {
+    struct name_snapshot name;
+    take_dentry_name_snapshot(&name, dentry);
+    struct dentry* parent = dget_parent(dentry);
+    err = vtfs_backend_lookup(inode->i_sb, d_inode(parent)->i_ino, name.name.name, &meta);
+    dput(parent);
+    release_dentry_name_snapshot(&name);
+  }
+  if (err)
+    return err;
+  if (meta.ino != inode->i_ino)
+    return -ESTALE;
+
+  vtfs_update_inode(inode, &meta);
+  return 0;
+}
+
+static void vtfs_dentry_verified(struct dentry* dentry) {
+  dentry->d_time = jiffies;
+}
+
+// one VFS inode per backend inode, whichever name it is reached by; an inode that is already
+// cached keeps its attributes unless the backend is remote, a local backend's size may lag
+// behind the dirty page cache but is changed by nobody else
 struct inode* vtfs_get_inode(
-    struct super_block* sb, const struct inode* dir, umode_t mode, int i_ino
+    struct super_block* sb, const struct inode* dir, const struct vtfs_node_meta* meta
 ) {
-  struct inode* inode = new_inode(sb);
-  if (inode != NULL) {
-    inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
-    inode->i_mode = mode;
-    inode->i_op = &vtfs_inode_ops;
-
-    if (S_ISDIR(mode))
-      inode->i_fop = &vtfs_dir_ops;
-    else if (S_ISREG(mode)) {
-      inode->i_fop = &vtfs_file_ops;
-    }
+  struct inode* inode = iget_locked(sb, meta->ino);
+  if (!inode)
+    return NULL;
+  if (!(inode->i_state & I_NEW)) {
+    if (VTFS_SB(sb)->remote)
+      vtfs_update_inode(inode, meta);
+    return inode;
+  }
 
-    inode->i_mode = mode | 0777;
+  umode_t mode = meta->mode;
+  inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
+  inode->i_mode = mode;
+  inode->i_op = &vtfs_inode_ops;
+
+  if (S_ISDIR(mode))
+    inode->i_fop = &vtfs_dir_ops;
+  else if (S_ISREG(mode)) {
+    inode->i_fop = &vtfs_file_ops;
+    inode->i_mapping->a_ops = &vtfs_aops;
   }
-  inode->i_ino = i_ino;
+
+  inode->i_mode = mode | 0777;
+  inode->i_size = meta->size;
+  set_nlink(inode, meta->nlink);
+  VTFS_I(inode)->attr_time = jiffies;
+  VTFS_I(inode)->attr_ttl = vtfs_attr_ttl_min(inode);
+  unlock_new_inode(inode);
   return inode;
 }
 
+struct inode* vtfs_alloc_inode(struct super_block* sb) {
+  struct vtfs_inode_info* vi = alloc_inode_sb(sb, vtfs_inode_cachep, GFP_KERNEL);
+  if (!vi)
+    return NULL;
+
+  vi->attr_time = 0;
+  vi->attr_ttl = 0;
+  return &vi->vfs_inode;
+}
+
+void vtfs_free_inode(struct inode* inode) {
+  kmem_cache_free(vtfs_inode_cachep, VTFS_I(inode));
+}
+
+// a remote backend's dentries are trusted for the parent's attribute lifetime and its misses
+// for negtimeo, then looked up again
+int vtfs_d_revalidate(
+    struct inode* dir, const struct qstr* name, struct dentry* dentry, unsigned int flags
+) {
+  struct vtfs_sb_info* sbi = VTFS_SB(dentry->d_sb);
+  struct inode* inode = d_inode_rcu(dentry);
+  unsigned long ttl = inode ? VTFS_I(dir)->attr_ttl : sbi->negtimeo;
+  if (time_before(jiffies, dentry->d_time + ttl)) {
+    vtfs_stat_add(sbi->stats, VTFS_CNT_DENTRY_HITS, 1);
+    return 1;
+  }
+  if (flags & LOOKUP_RCU)
+    return -ECHILD;
+
+  vtfs_stat_add(sbi->stats, VTFS_CNT_DENTRY_MISSES, 1);
+  struct vtfs_node_meta meta;
+  int err = vtfs_backend_lookup(dentry->d_sb, dir->i_ino, name->name, &meta);
+  if (err == -ENOENT && !inode) {
+    vtfs_dentry_verified(dentry);
+    return 1;
+  }
+  if (err == -ENOENT || (!err && (!inode || meta.ino != inode->i_ino)))
+    return 0;
+  if (err)
+    return err;
+
+  vtfs_update_inode(inode, &meta);
+  vtfs_dentry_verified(dentry);
+  return 1;
+}
+
+int vtfs_getattr(
+    struct mnt_idmap* idmap,
+    const struct path* path,
+    struct kstat* stat,
+    u32 request_mask,
+    unsigned int query_flags
+) {
+  struct inode* inode = d_inode(path->dentry);
+  struct vtfs_sb_info* sbi = VTFS_SB(inode->i_sb);
+  unsigned int sync = query_flags & AT_STATX_SYNC_TYPE;
+
+  if (sbi->remote && sync != AT_STATX_DONT_SYNC &&
+      (sync == AT_STATX_FORCE_SYNC || !vtfs_attrs_fresh(inode))) {
+    vtfs_stat_add(sbi->stats, VTFS_CNT_ATTR_MISSES, 1);
+    int err = vtfs_refresh_inode(path->dentry);
+    if (err)
+      return err;
+  } else if (sbi->remote) {
+    vtfs_stat_add(sbi->stats, VTFS_CNT_ATTR_HITS, 1);
+  }
+
+  generic_fillattr(idmap, request_mask, inode, stat);
+  return 0;
+}
+
+// a remote backend may hand the ino of an inode with no links left to a new one, while the old
+// one lives on until its last file is closed; a local one keeps it until vtfs_evict_inode
+static void vtfs_forget_inode(struct inode* inode) {
+  if (!inode->i_nlink)
+    remove_inode_hash(inode);
+}
+
 void vtfs_kill_sb(struct super_block* sb) {
   kill_litter_super(sb);
+
+  struct vtfs_sb_info* sbi = VTFS_SB(sb);
+  if (sbi) {
+    if (sbi->ops)
+      sbi->ops->kill_sb(sb);
+    debugfs_remove_recursive(sbi->debugfs_dir);
+    vtfs_stats_free(sbi->stats);
+    kfree(sbi);
+  }
   printk(KERN_INFO "vtfs super block is destroyed. Unmount successfully.\n");
 }
 
+int vtfs_statfs(struct dentry* dentry, struct kstatfs* buf) {
+  int err = simple_statfs(dentry, buf);
+  if (err)
+    return err;
+
+  err = VTFS_SB(dentry->d_sb)->ops->statfs(dentry->d_sb, buf);
+  return err == -EOPNOTSUPP ? 0 : err;
+}
+
 struct dentry* vtfs_lookup(
     struct inode* parent_inode, struct dentry* child_dentry, unsigned int flag
 ) {
   const char* name = child_dentry->d_name.name;
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("lookup", parent_inode->i_ino, name, 0, 0);
+
   struct vtfs_node_meta meta;
-  int err = vtfs_storage_lookup(parent_inode->i_ino, name, &meta);
+  struct inode* inode = NULL;
+  int err = vtfs_backend_lookup(parent_inode->i_sb, parent_inode->i_ino, name, &meta);
+  if (err && err != -ENOENT)
+    goto out;
+
+  vtfs_dentry_verified(child_dentry);
+  // a miss is cached too, as a negative dentry
+  if (!err) {
+    inode = vtfs_get_inode(parent_inode->i_sb, NULL, &meta);
+    if (!inode) {
+      err = -ENOMEM;
+      goto out;
+    }
+  }
+  d_add(child_dentry, inode);
+  err = 0;
+out:
+  trace_vtfs_op_exit("lookup", parent_inode->i_ino, err, start);
+  return err ? ERR_PTR(err) : NULL;
+}
 
-  if (err) {
-    return NULL;
+// entries asked of the backend at once by vtfs_iterate_plus
+#define VTFS_READDIR_BATCH 64
+
+// instantiates a listed entry in the dcache unless it is there already, so the lookups and stats
+// that usually follow a listing cost no further requests
+static void vtfs_prime_dcache(struct dentry* parent, const struct vtfs_dirent_plus* e) {
+  struct qstr name = QSTR_INIT(e->ent.name, strlen(e->ent.name));
+  name.hash = full_name_hash(parent, name.name, name.len);
+
+  struct dentry* dentry = d_lookup(parent, &name);
+  if (dentry) {
+    struct inode* inode = d_inode(dentry);
+    if (inode && inode->i_ino == e->meta.ino) {
+      vtfs_update_inode(inode, &e->meta);
+      vtfs_dentry_verified(dentry);
+    }
+    dput(dentry);
+    return;
   }
 
-  struct inode* inode = vtfs_get_inode(parent_inode->i_sb, NULL, meta.mode, meta.ino);
-  if (!inode) {
-    return ERR_PTR(-ENOMEM);
+  DECLARE_WAIT_QUEUE_HEAD_ONSTACK(wq);
+  dentry = d_alloc_parallel(parent, &name, &wq);
+  if (IS_ERR(dentry))
+    return;
+  // somebody else is looking it up, or already has
+  if (!d_in_lookup(dentry)) {
+    dput(dentry);
+    return;
   }
 
-  inode->i_size = meta.size;
-  set_nlink(inode, meta.nlink);
-  d_add(child_dentry, inode);
-  return NULL;
+  struct inode* inode = vtfs_get_inode(parent->d_sb, NULL, &e->meta);
+  if (inode) {
+    vtfs_dentry_verified(dentry);
+    struct dentry* alias = d_splice_alias(inode, dentry);
+    if (!IS_ERR_OR_NULL(alias))
+      dput(alias);
+  }
+  d_lookup_done(dentry);
+  dput(dentry);
 }
 
-int vtfs_iterate(struct file* filp, struct dir_context* ctx) {
+// lists the directory a batch at a time, with attributes; -EOPNOTSUPP before emitting anything
+// if the backend can't
+static int vtfs_iterate_plus(struct dentry* dentry, struct dir_context* ctx) {
+  struct vtfs_dirent_plus* batch = kmalloc_array(VTFS_READDIR_BATCH, sizeof(*batch), GFP_KERNEL);
+  if (!batch)
+    return -ENOMEM;
+
+  int ret;
+  while (1) {
+    struct vtfs_sb_info* sbi = VTFS_SB(dentry->d_sb);
+    ret = vtfs_stat_call(
+        sbi->stats,
+        VTFS_OP_ITERATE_DIR,
+        sbi->ops->iterate_dir_plus(
+            dentry->d_sb, d_inode(dentry)->i_ino, ctx->pos - 2, batch, VTFS_READDIR_BATCH
+        )
+    );
+    if (ret <= 0)
+      break;
+
+    for (int i = 0; i < ret; i++) {
+      struct vtfs_dirent* ent = &batch[i].ent;
+      unsigned char dtype = (ent->type == VTFS_NODE_DIR) ? DT_DIR : DT_REG;
+
+      vtfs_prime_dcache(dentry, &batch[i]);
+      if (!dir_emit(ctx, ent->name, strlen(ent->name), ent->ino, dtype)) {
+        kfree(batch);
+        return 0;
+      }
+      ctx->pos = batch[i].next + 2;
+    }
+  }
+
+  kfree(batch);
+  if (ret < 0 && ret != -EOPNOTSUPP)
+    LOG("iterate_dir_plus failed: %d\n", ret);
+  return ret;
+}
+
+static int vtfs_do_iterate(struct file* filp, struct dir_context* ctx) {
   struct dentry* dentry = filp->f_path.dentry;
   struct inode* inode = dentry->d_inode;
   vtfs_ino_t ino = inode->i_ino;
@@ -175,11 +831,22 @@ int vtfs_iterate(struct file* filp, struct dir_context* ctx) {
     pos = 2;
   }
 
-  unsigned long off = pos - 2;
+  // a local backend answers lookups as cheaply as it lists
+  int ret;
+  if (VTFS_SB(inode->i_sb)->remote) {
+    ret = vtfs_iterate_plus(dentry, ctx);
+    if (ret != -EOPNOTSUPP)
+      return ret;
+  }
+
+  unsigned long off = ctx->pos - 2;
 
   while (1) {
     struct vtfs_dirent ent;
-    int ret = vtfs_storage_iterate_dir(ino, &off, &ent);
+    struct vtfs_sb_info* sbi = VTFS_SB(inode->i_sb);
+    ret = vtfs_stat_call(
+        sbi->stats, VTFS_OP_ITERATE_DIR, sbi->ops->iterate_dir(inode->i_sb, ino, &off, &ent)
+    );
 
     if (ret < 0) {
       LOG("iterate_dir failed: %d\n", ret);
@@ -199,13 +866,24 @@ int vtfs_iterate(struct file* filp, struct dir_context* ctx) {
   }
 }
 
+int vtfs_iterate(struct file* filp, struct dir_context* ctx) {
+  unsigned long ino = file_inode(filp)->i_ino;
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("iterate", ino, NULL, ctx->pos, 0);
+
+  int ret = vtfs_do_iterate(filp, ctx);
+  trace_vtfs_op_exit("iterate", ino, ret, start);
+  return ret;
+}
+
 int vtfs_open(struct inode* inode, struct file* filp) {
-  LOG("vtfs_open called for inode %lu\n", inode->i_ino);
+  trace_vtfs_op_enter("open", inode->i_ino, NULL, 0, 0);
+  filp->f_mode |= FMODE_CAN_ODIRECT;
   return 0;
 }
 
 int vtfs_release(struct inode* inode, struct file* filp) {
-  LOG("vtfs_release called for inode %lu\n", inode->i_ino);
+  trace_vtfs_op_enter("release", inode->i_ino, NULL, 0, 0);
   return 0;
 }
 
@@ -218,29 +896,50 @@ int vtfs_create(
 ) {
   const char* name = child_dentry->d_name.name;
   struct vtfs_node_meta meta;
-  int err;
-
-  LOG("vtfs_create called! parent_inode=%lu, name=%s\n", parent_inode->i_ino, name);
-
-  err = vtfs_storage_create_file(parent_inode->i_ino, name, mode, &meta);
-  if (err) {
-    return err;
-  }
+  struct inode* inode;
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("create", parent_inode->i_ino, name, 0, 0);
+
+  struct vtfs_sb_info* sbi = VTFS_SB(parent_inode->i_sb);
+  int err = vtfs_stat_call(
+      sbi->stats,
+      VTFS_OP_CREATE,
+      sbi->ops->create_file(parent_inode->i_sb, parent_inode->i_ino, name, mode, &meta)
+  );
+  if (err)
+    goto out;
 
-  struct inode* inode = vtfs_get_inode(parent_inode->i_sb, NULL, meta.mode, (int)meta.ino);
+  inode = vtfs_get_inode(parent_inode->i_sb, NULL, &meta);
   if (!inode) {
-    return -ENOMEM;
+    err = -ENOMEM;
+    goto out;
   }
 
-  inode->i_size = meta.size;
-  set_nlink(inode, meta.nlink);
-  d_add(child_dentry, inode);
-  return 0;
+  // the dentry may be a cached miss, already hashed
+  vtfs_dentry_verified(child_dentry);
+  d_instantiate(child_dentry, inode);
+out:
+  trace_vtfs_op_exit("create", parent_inode->i_ino, err, start);
+  return err;
 }
 
 int vtfs_unlink(struct inode* parent_inode, struct dentry* child_dentry) {
   const char* name = child_dentry->d_name.name;
-  return vtfs_storage_unlink(parent_inode->i_ino, name);
+  struct inode* inode = d_inode(child_dentry);
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("unlink", parent_inode->i_ino, name, 0, 0);
+
+  struct vtfs_sb_info* sbi = VTFS_SB(parent_inode->i_sb);
+  int err = vtfs_stat_call(
+      sbi->stats, VTFS_OP_UNLINK, sbi->ops->unlink(parent_inode->i_sb, parent_inode->i_ino, name)
+  );
+  if (!err) {
+    drop_nlink(inode);
+    vtfs_forget_inode(inode);
+  }
+
+  trace_vtfs_op_exit("unlink", parent_inode->i_ino, err, start);
+  return err;
 }
 
 // --- dirs ---
@@ -249,95 +948,714 @@ struct dentry* vtfs_mkdir(
 ) {
   const char* name = child_dentry->d_name.name;
   struct vtfs_node_meta meta;
-  int err;
-
-  err = vtfs_storage_mkdir(parent_inode->i_ino, name, mode, &meta);
+  struct inode* inode;
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("mkdir", parent_inode->i_ino, name, 0, 0);
+
+  struct vtfs_sb_info* sbi = VTFS_SB(parent_inode->i_sb);
+  int err = vtfs_stat_call(
+      sbi->stats,
+      VTFS_OP_MKDIR,
+      sbi->ops->mkdir(parent_inode->i_sb, parent_inode->i_ino, name, mode, &meta)
+  );
   if (err)
-    return ERR_PTR(err);
+    goto out;
 
-  struct inode* inode = vtfs_get_inode(parent_inode->i_sb, parent_inode, meta.mode, (int)meta.ino);
-  if (!inode)
-    return ERR_PTR(-ENOMEM);
+  inode = vtfs_get_inode(parent_inode->i_sb, parent_inode, &meta);
+  if (!inode) {
+    err = -ENOMEM;
+    goto out;
+  }
 
-  inode->i_size = meta.size;
-  set_nlink(inode, meta.nlink);
+  vtfs_dentry_verified(child_dentry);
   d_instantiate(child_dentry, inode);
   inc_nlink(parent_inode);
-  set_nlink(inode, meta.nlink);
-  return NULL;
+out:
+  trace_vtfs_op_exit("mkdir", parent_inode->i_ino, err, start);
+  return err ? ERR_PTR(err) : NULL;
 }
 
 int vtfs_rmdir(struct inode* parent_inode, struct dentry* child_dentry) {
   const char* name = child_dentry->d_name.name;
-  return vtfs_storage_rmdir(parent_inode->i_ino, name);
+  struct inode* inode = d_inode(child_dentry);
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("rmdir", parent_inode->i_ino, name, 0, 0);
+
+  struct vtfs_sb_info* sbi = VTFS_SB(parent_inode->i_sb);
+  int err = vtfs_stat_call(
+      sbi->stats, VTFS_OP_RMDIR, sbi->ops->rmdir(parent_inode->i_sb, parent_inode->i_ino, name)
+  );
+  if (!err) {
+    clear_nlink(inode);
+    drop_nlink(parent_inode);
+    vtfs_forget_inode(inode);
+  }
+
+  trace_vtfs_op_exit("rmdir", parent_inode->i_ino, err, start);
+  return err;
 }
 
 // --- file r/w ---
-ssize_t vtfs_read(struct file* filp, char __user* buffer, size_t len, loff_t* offset) {
-  if (!len)
+// data calls to the backend, timed and counted in the mount's stats and dispatched without an
+// indirect branch
+static ssize_t vtfs_backend_read(struct inode* inode, loff_t pos, struct iov_iter* to) {
+  struct vtfs_sb_info* sbi = VTFS_SB(inode->i_sb);
+  ssize_t n = vtfs_stat_call(
+      sbi->stats,
+      VTFS_OP_READ,
+      INDIRECT_CALL_2(
+          sbi->ops->read_iter,
+          vtfs_lavnetfs_read_iter,
+          vtfs_ram_read_iter,
+          inode->i_sb,
+          inode->i_ino,
+          pos,
+          to
+      )
+  );
+  if (n > 0)
+    vtfs_stat_add(sbi->stats, VTFS_CNT_BACKEND_READ_BYTES, n);
+  return n;
+}
+
+static ssize_t vtfs_backend_write(
+    struct inode* inode, loff_t pos, struct iov_iter* from, loff_t* new_size
+) {
+  struct vtfs_sb_info* sbi = VTFS_SB(inode->i_sb);
+  ssize_t n = vtfs_stat_call(
+      sbi->stats,
+      VTFS_OP_WRITE,
+      INDIRECT_CALL_2(
+          sbi->ops->write_iter,
+          vtfs_lavnetfs_write_iter,
+          vtfs_ram_write_iter,
+          inode->i_sb,
+          inode->i_ino,
+          pos,
+          from,
+          new_size
+      )
+  );
+  if (n > 0)
+    vtfs_stat_add(sbi->stats, VTFS_CNT_BACKEND_WRITE_BYTES, n);
+  return n;
+}
+
+// fills a folio from the backend; the part past EOF is zeroed without asking it
+static int vtfs_fill_folio(struct inode* inode, struct folio* folio) {
+  loff_t pos = folio_pos(folio);
+  loff_t size = i_size_read(inode);
+  size_t len = folio_size(folio);
+  size_t avail = pos < size ? min_t(loff_t, len, size - pos) : 0;
+  ssize_t n = 0;
+
+  if (avail) {
+    struct bio_vec bv;
+    struct iov_iter iter;
+    bvec_set_folio(&bv, folio, avail, 0);
+    iov_iter_bvec(&iter, ITER_DEST, &bv, 1, avail);
+    n = vtfs_backend_read(inode, pos, &iter);
+    if (n < 0)
+      return n;
+  }
+  folio_zero_range(folio, n, len - n);
+  return 0;
+}
+
+int vtfs_read_folio(struct file* file, struct folio* folio) {
+  unsigned long ino = folio->mapping->host->i_ino;
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("read_folio", ino, NULL, folio_pos(folio), folio_size(folio));
+
+  int err = vtfs_fill_folio(folio->mapping->host, folio);
+  folio_end_read(folio, !err);
+  trace_vtfs_op_exit("read_folio", ino, err, start);
+  return err;
+}
+
+// reads the whole window with one backend call, straight into the locked folios
+void vtfs_readahead(struct readahead_control* rac) {
+  struct inode* inode = rac->mapping->host;
+  loff_t pos = readahead_pos(rac);
+  loff_t size = i_size_read(inode);
+  size_t avail = pos < size ? min_t(loff_t, readahead_length(rac), size - pos) : 0;
+  ssize_t n = 0;
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("readahead", inode->i_ino, NULL, pos, readahead_length(rac));
+
+  if (avail) {
+    struct iov_iter iter;
+    iov_iter_xarray(&iter, ITER_DEST, &rac->mapping->i_pages, pos, avail);
+    n = vtfs_backend_read(inode, pos, &iter);
+  }
+  trace_vtfs_op_exit("readahead", inode->i_ino, n, start);
+
+  struct folio* folio;
+  size_t off = 0;
+  while ((folio = readahead_folio(rac))) {
+    if (n >= 0) {
+      size_t len = folio_size(folio);
+      size_t filled = off < (size_t)n ? min_t(size_t, len, n - off) : 0;
+      folio_zero_range(folio, filled, len - filled);
+      off += len;
+    }
+    // folios left not uptodate are read again one by one through read_folio
+    folio_end_read(folio, n >= 0);
+  }
+}
+
+int vtfs_write_begin(
+    const struct kiocb* iocb,
+    struct address_space* mapping,
+    loff_t pos,
+    unsigned int len,
+    struct folio** foliop,
+    void** fsdata
+) {
+  struct folio* folio = __filemap_get_folio(
+      mapping, pos >> PAGE_SHIFT, FGP_WRITEBEGIN, mapping_gfp_mask(mapping)
+  );
+  if (IS_ERR(folio))
+    return PTR_ERR(folio);
+
+  *foliop = folio;
+  if (folio_test_uptodate(folio))
     return 0;
 
-  char* kbuf = kmalloc(len, GFP_KERNEL);
-  if (!kbuf)
-    return -ENOMEM;
+  // a write over the whole folio needs none of the old data
+  if (offset_in_folio(folio, pos) == 0 && len == folio_size(folio))
+    return 0;
 
-  ssize_t copied = vtfs_storage_read_file(filp->f_inode->i_ino, *offset, len, kbuf);
-  if (copied < 0) {
-    kfree(kbuf);
-    return copied;
+  int err = vtfs_fill_folio(mapping->host, folio);
+  if (err) {
+    folio_unlock(folio);
+    folio_put(folio);
+    return err;
   }
+  folio_mark_uptodate(folio);
+  return 0;
+}
 
-  if (copy_to_user(buffer, kbuf, copied)) {
-    kfree(kbuf);
-    return -EFAULT;
+int vtfs_write_end(
+    const struct kiocb* iocb,
+    struct address_space* mapping,
+    loff_t pos,
+    unsigned int len,
+    unsigned int copied,
+    struct folio* folio,
+    void* fsdata
+) {
+  struct inode* inode = mapping->host;
+
+  if (!folio_test_uptodate(folio)) {
+    // the folio was never read in, a short copy would leave part of it undefined; the caller
+    // retries the write
+    if (copied < len) {
+      copied = 0;
+      goto out;
+    }
+    folio_mark_uptodate(folio);
   }
 
-  *offset += copied;
-  kfree(kbuf);
+  if (pos + copied > inode->i_size)
+    i_size_write(inode, pos + copied);
+  folio_mark_dirty(folio);
+out:
+  folio_unlock(folio);
+  folio_put(folio);
   return copied;
 }
 
-ssize_t vtfs_write(struct file* filp, const char __user* buffer, size_t len, loff_t* offset) {
-  if (!len)
+// dirty folios that follow each other in the file are written back with one backend call
+struct vtfs_wb_run {
+  struct folio_batch batch;
+  loff_t pos;
+  size_t len;
+};
+
+static int vtfs_wb_flush(struct address_space* mapping, struct vtfs_wb_run* run) {
+  int err = 0;
+  if (run->len) {
+    unsigned long ino = mapping->host->i_ino;
+    u64 start = vtfs_trace_start(vtfs_op_exit);
+    trace_vtfs_op_enter("writeback", ino, NULL, run->pos, run->len);
+
+    struct iov_iter iter;
+    iov_iter_xarray(&iter, ITER_SOURCE, &mapping->i_pages, run->pos, run->len);
+    ssize_t n = vtfs_backend_write(mapping->host, run->pos, &iter, NULL);
+    err = n < 0 ? n : n < run->len ? -EIO : 0;
+    trace_vtfs_op_exit("writeback", ino, n, start);
+  }
+  if (err) {
+    LOG("writeback of ino=%lu at %lld failed: %d\n", mapping->host->i_ino, run->pos, err);
+    mapping_set_error(mapping, err);
+  }
+
+  for (unsigned int i = 0; i < folio_batch_count(&run->batch); i++)
+    folio_end_writeback(run->batch.folios[i]);
+  folio_batch_release(&run->batch);
+  run->len = 0;
+  return err;
+}
+
+int vtfs_writepages(struct address_space* mapping, struct writeback_control* wbc) {
+  struct inode* inode = mapping->host;
+  struct vtfs_wb_run run = {};
+  struct folio* folio = NULL;
+  int err = 0;
+
+  folio_batch_init(&run.batch);
+  while ((folio = writeback_iter(mapping, wbc, folio, &err))) {
+    loff_t pos = folio_pos(folio);
+    loff_t size = i_size_read(inode);
+    if (pos >= size) {
+      // truncated away since it was dirtied
+      folio_unlock(folio);
+      continue;
+    }
+
+    if (run.len && (pos != run.pos + run.len || !folio_batch_space(&run.batch)))
+      err = vtfs_wb_flush(mapping, &run);
+    if (!run.len)
+      run.pos = pos;
+
+    // the folios stay in the page cache under writeback until the run is flushed
+    run.len += min_t(loff_t, folio_size(folio), size - pos);
+    folio_start_writeback(folio);
+    folio_get(folio);
+    folio_batch_add(&run.batch, folio);
+    folio_unlock(folio);
+  }
+
+  int flush_err = vtfs_wb_flush(mapping, &run);
+  return err ? err : flush_err;
+}
+
+// reads and writes skip the page cache with O_DIRECT, and always when the backend holds the
+// data in memory itself
+static bool vtfs_io_direct(struct kiocb* iocb) {
+  struct vtfs_sb_info* sbi = VTFS_SB(file_inode(iocb->ki_filp)->i_sb);
+  return iocb->ki_flags & IOCB_DIRECT || sbi->ops->flags & VTFS_STORAGE_NOCACHE;
+}
+
+// O_DIRECT copies between the backend and the caller's buffer without the page cache
+static ssize_t vtfs_direct_read(struct kiocb* iocb, struct iov_iter* to) {
+  struct inode* inode = file_inode(iocb->ki_filp);
+  loff_t pos = iocb->ki_pos;
+  size_t count = iov_iter_count(to);
+  loff_t size = i_size_read(inode);
+
+  if (!count || pos >= size)
     return 0;
 
-  if (filp->f_flags & O_APPEND)
-    *offset = filp->f_inode->i_size;
+  // the backend must see what buffered writes left in the page cache
+  size_t len = min_t(loff_t, count, size - pos);
+  int err = filemap_write_and_wait_range(inode->i_mapping, pos, pos + len - 1);
+  if (err)
+    return err;
+
+  iov_iter_truncate(to, len);
+  ssize_t n = vtfs_backend_read(inode, pos, to);
+  iov_iter_reexpand(to, iov_iter_count(to) + count - len);
+  if (n > 0)
+    iocb->ki_pos += n;
+  file_accessed(iocb->ki_filp);
+  return n;
+}
+
+static ssize_t vtfs_direct_write(struct kiocb* iocb, struct iov_iter* from) {
+  struct inode* inode = file_inode(iocb->ki_filp);
+
+  inode_lock(inode);
+  ssize_t ret = generic_write_checks(iocb, from);
+  if (ret <= 0)
+    goto out;
+  ret = file_modified(iocb->ki_filp);
+  if (ret)
+    goto out;
+
+  size_t count = iov_iter_count(from);
+  ret = kiocb_invalidate_pages(iocb, count);
+  if (ret)
+    goto out;
+
+  loff_t new_size;
+  ret = vtfs_backend_write(inode, iocb->ki_pos, from, &new_size);
+  if (ret > 0) {
+    // pages read in while the write was in flight
+    kiocb_invalidate_post_direct_write(iocb, ret);
+    iocb->ki_pos += ret;
+    if (new_size > i_size_read(inode))
+      i_size_write(inode, new_size);
+  }
+out:
+  inode_unlock(inode);
+  return ret > 0 ? generic_write_sync(iocb, ret) : ret;
+}
+
+int vtfs_mmap(struct file* file, struct vm_area_struct* vma) {
+  file_accessed(file);
+  vma->vm_ops = &vtfs_file_vm_ops;
+  return 0;
+}
+
+// first write to a page of a shared mapping, or the first since it was last written back
+vm_fault_t vtfs_page_mkwrite(struct vm_fault* vmf) {
+  struct file* file = vmf->vma->vm_file;
+  struct inode* inode = file_inode(file);
+  struct folio* folio = page_folio(vmf->page);
+  vm_fault_t ret = VM_FAULT_LOCKED;
+
+  sb_start_pagefault(inode->i_sb);
+  // excludes a truncate between writing back the pages it drops and dropping them
+  filemap_invalidate_lock_shared(inode->i_mapping);
+  file_update_time(file);
+  folio_lock(folio);
+  if (folio->mapping != inode->i_mapping || folio_pos(folio) >= i_size_read(inode)) {
+    // truncated while we waited for the lock, the fault is retried
+    folio_unlock(folio);
+    ret = VM_FAULT_NOPAGE;
+    goto out;
+  }
+  folio_mark_dirty(folio);
+  folio_wait_stable(folio);
+out:
+  filemap_invalidate_unlock_shared(inode->i_mapping);
+  sb_end_pagefault(inode->i_sb);
+  return ret;
+}
+
+// sendfile and splice; backends that keep data in pages give the pipe references to them,
+// the others go through the page cache
+ssize_t vtfs_splice_read(
+    struct file* in, loff_t* ppos, struct pipe_inode_info* pipe, size_t len, unsigned int flags
+) {
+  struct inode* inode = file_inode(in);
+  loff_t size = i_size_read(inode);
+  if (!len || *ppos >= size)
+    return 0;
+  len = min_t(loff_t, len, size - *ppos);
+
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("splice_read", inode->i_ino, NULL, *ppos, len);
+
+  // the backend only has what has been written back
+  ssize_t ret = filemap_write_and_wait_range(inode->i_mapping, *ppos, *ppos + len - 1);
+  if (ret)
+    goto out;
+
+  struct vtfs_sb_info* sbi = VTFS_SB(inode->i_sb);
+  ret = vtfs_stat_call(
+      sbi->stats,
+      VTFS_OP_SPLICE_READ,
+      sbi->ops->splice_read(inode->i_sb, inode->i_ino, ppos, pipe, len)
+  );
+  if (ret > 0)
+    file_accessed(in);
+  if (ret != -EOPNOTSUPP)
+    goto out;
+
+  if (in->f_flags & O_DIRECT)
+    ret = copy_splice_read(in, ppos, pipe, len, flags);
+  else
+    ret = filemap_splice_read(in, ppos, pipe, len, flags);
+out:
+  trace_vtfs_op_exit("splice_read", inode->i_ino, ret, start);
+  return ret;
+}
+
+ssize_t vtfs_file_read_iter(struct kiocb* iocb, struct iov_iter* to) {
+  unsigned long ino = file_inode(iocb->ki_filp)->i_ino;
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("read_iter", ino, NULL, iocb->ki_pos, iov_iter_count(to));
+
+  ssize_t ret;
+  if (vtfs_io_direct(iocb))
+    ret = vtfs_direct_read(iocb, to);
+  else
+    ret = generic_file_read_iter(iocb, to);
+  if (ret > 0)
+    vtfs_stat_add(VTFS_SB(file_inode(iocb->ki_filp)->i_sb)->stats, VTFS_CNT_READ_BYTES, ret);
+  trace_vtfs_op_exit("read_iter", ino, ret, start);
+  return ret;
+}
+
+ssize_t vtfs_file_write_iter(struct kiocb* iocb, struct iov_iter* from) {
+  unsigned long ino = file_inode(iocb->ki_filp)->i_ino;
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("write_iter", ino, NULL, iocb->ki_pos, iov_iter_count(from));
+
+  ssize_t ret;
+  if (vtfs_io_direct(iocb))
+    ret = vtfs_direct_write(iocb, from);
+  else
+    ret = generic_file_write_iter(iocb, from);
+  if (ret > 0)
+    vtfs_stat_add(VTFS_SB(file_inode(iocb->ki_filp)->i_sb)->stats, VTFS_CNT_WRITE_BYTES, ret);
+  trace_vtfs_op_exit("write_iter", ino, ret, start);
+  return ret;
+}
+
+// the VFS doesn't write an inode back before evicting it; the data of one with no links left
+// has nowhere to go, and the backend may reuse its ino from now on
+void vtfs_evict_inode(struct inode* inode) {
+  if (S_ISREG(inode->i_mode) && inode->i_nlink)
+    filemap_write_and_wait(inode->i_mapping);
+  truncate_inode_pages_final(&inode->i_data);
+  clear_inode(inode);
+  VTFS_SB(inode->i_sb)->ops->evict(inode->i_sb, inode->i_ino);
+}
+
+loff_t vtfs_llseek(struct file* filp, loff_t offset, int whence) {
+  struct inode* inode = file_inode(filp);
+
+  if (whence != SEEK_DATA && whence != SEEK_HOLE)
+    return generic_file_llseek(filp, offset, whence);
+
+  if (offset < 0)
+    return -ENXIO;
+
+  // the backend only knows about data that has been written back
+  int err = filemap_write_and_wait(inode->i_mapping);
+  if (err)
+    return err;
+
+  loff_t pos;
+  struct vtfs_sb_info* sbi = VTFS_SB(inode->i_sb);
+  err = vtfs_stat_call(
+      sbi->stats,
+      VTFS_OP_SEEK_DATA,
+      sbi->ops->seek_data(inode->i_sb, inode->i_ino, offset, whence, &pos)
+  );
+  if (err == -EOPNOTSUPP)
+    return generic_file_llseek(filp, offset, whence);
+  if (err)
+    return err;
+
+  return vfs_setpos(filp, pos, inode->i_sb->s_maxbytes);
+}
+
+// FICLONE/FICLONERANGE; the RAM backend shares the pages instead of copying them
+loff_t vtfs_remap_file_range(
+    struct file* file_in,
+    loff_t pos_in,
+    struct file* file_out,
+    loff_t pos_out,
+    loff_t len,
+    unsigned int remap_flags
+) {
+  struct inode* inode_in = file_inode(file_in);
+  struct inode* inode_out = file_inode(file_out);
+
+  if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+    return -EINVAL;
+  // FIDEDUPERANGE is left to the RAM backend's own background dedup
+  if (remap_flags & REMAP_FILE_DEDUP)
+    return -EOPNOTSUPP;
 
-  char* kbuf = memdup_user(buffer, len);
-  if (IS_ERR(kbuf))
-    return PTR_ERR(kbuf);
+  lock_two_nondirectories(inode_in, inode_out);
+  loff_t ret =
+      generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out, &len, remap_flags);
+  if (ret < 0 || len == 0)
+    goto out;
 
   loff_t new_size;
-  ssize_t written = vtfs_storage_write_file(filp->f_inode->i_ino, *offset, kbuf, len, &new_size);
+  struct vtfs_sb_info* sbi = VTFS_SB(inode_out->i_sb);
+  ssize_t copied = vtfs_stat_call(
+      sbi->stats,
+      VTFS_OP_COPY_RANGE,
+      sbi->ops->copy_range(
+          inode_out->i_sb,
+          inode_in->i_ino,
+          pos_in,
+          inode_out->i_ino,
+          pos_out,
+          len,
+          &new_size
+      )
+  );
+  if (copied <= 0) {
+    ret = copied < 0 ? copied : -ENOSPC;
+    goto out;
+  }
+
+  // the prep wrote both ranges back, the cached destination pages are stale now
+  invalidate_inode_pages2_range(
+      inode_out->i_mapping, pos_out >> PAGE_SHIFT, (pos_out + copied - 1) >> PAGE_SHIFT
+  );
+  i_size_write(inode_out, new_size);
+  // a short clone would leave the destination half cloned, report it as an error
+  ret = copied == len ? len : -ENOSPC;
+out:
+  unlock_two_nondirectories(inode_in, inode_out);
+  return ret;
+}
+
+// copies through a kernel buffer for backends that can't copy on their own
+static ssize_t vtfs_copy_through_kernel(
+    struct inode* inode_in,
+    loff_t pos_in,
+    struct inode* inode_out,
+    loff_t pos_out,
+    size_t len,
+    loff_t* new_size
+) {
+  char* kbuf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+  if (!kbuf)
+    return -ENOMEM;
+
+  struct vtfs_sb_info* sbi = VTFS_SB(inode_out->i_sb);
+  size_t done = 0;
+  ssize_t ret = 0;
+  while (done < len) {
+    size_t chunk = min_t(size_t, len - done, PAGE_SIZE);
+    ret = vtfs_stat_call(
+        sbi->stats,
+        VTFS_OP_READ,
+        sbi->ops->read_file(inode_out->i_sb, inode_in->i_ino, pos_in + done, chunk, kbuf)
+    );
+    if (ret <= 0)
+      break;
+    vtfs_stat_add(sbi->stats, VTFS_CNT_BACKEND_READ_BYTES, ret);
+
+    ret = vtfs_stat_call(
+        sbi->stats,
+        VTFS_OP_WRITE,
+        sbi->ops->write_file(inode_out->i_sb, inode_out->i_ino, pos_out + done, kbuf, ret, new_size)
+    );
+    if (ret <= 0)
+      break;
+    vtfs_stat_add(sbi->stats, VTFS_CNT_BACKEND_WRITE_BYTES, ret);
+
+    done += ret;
+    if (fatal_signal_pending(current))
+      break;
+  }
+
   kfree(kbuf);
+  return done ? (ssize_t)done : ret;
+}
 
-  if (written < 0)
-    return written;
+ssize_t vtfs_copy_file_range(
+    struct file* file_in,
+    loff_t pos_in,
+    struct file* file_out,
+    loff_t pos_out,
+    size_t len,
+    unsigned int flags
+) {
+  struct inode* inode_in = file_inode(file_in);
+  struct inode* inode_out = file_inode(file_out);
+
+  if (inode_in->i_sb != inode_out->i_sb)
+    return -EXDEV;
+
+  inode_lock(inode_out);
+  ssize_t ret = file_modified(file_out);
+  if (ret)
+    goto out;
+
+  // the backend copies what it has, which must include what is still dirty in the page cache
+  ret = filemap_write_and_wait_range(inode_in->i_mapping, pos_in, pos_in + len - 1);
+  if (!ret)
+    ret = filemap_write_and_wait_range(inode_out->i_mapping, pos_out, pos_out + len - 1);
+  if (ret)
+    goto out;
+
+  loff_t new_size = i_size_read(inode_out);
+  struct vtfs_sb_info* sbi = VTFS_SB(inode_out->i_sb);
+  ret = vtfs_stat_call(
+      sbi->stats,
+      VTFS_OP_COPY_RANGE,
+      sbi->ops->copy_range(
+          inode_out->i_sb,
+          inode_in->i_ino,
+          pos_in,
+          inode_out->i_ino,
+          pos_out,
+          len,
+          &new_size
+      )
+  );
+  if (ret == -EOPNOTSUPP)
+    ret = vtfs_copy_through_kernel(inode_in, pos_in, inode_out, pos_out, len, &new_size);
+  if (ret > 0) {
+    invalidate_inode_pages2_range(
+        inode_out->i_mapping, pos_out >> PAGE_SHIFT, (pos_out + ret - 1) >> PAGE_SHIFT
+    );
+    i_size_write(inode_out, new_size);
+  }
+out:
+  inode_unlock(inode_out);
+  return ret;
+}
+
+long vtfs_ioctl(struct file* filp, unsigned int cmd, unsigned long arg) {
+  switch (cmd) {
+    case VTFS_IOC_CHECKPOINT: {
+      struct super_block* sb = file_inode(filp)->i_sb;
+      if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+      // the image should also hold what the page cache hasn't written back yet
+      down_read(&sb->s_umount);
+      int err = sync_filesystem(sb);
+      up_read(&sb->s_umount);
+      return err ? err : VTFS_SB(sb)->ops->checkpoint(sb);
+    }
+    default:
+      return -ENOTTY;
+  }
+}
 
-  *offset += written;
-  filp->f_inode->i_size = new_size;
-  return written;
+// the backend tracks durability for the whole tree, not per file
+int vtfs_fsync(struct file* filp, loff_t start, loff_t end, int datasync) {
+  struct inode* inode = file_inode(filp);
+  unsigned long ino = inode->i_ino;
+  u64 trace_start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("fsync", ino, NULL, start, end - start);
+
+  struct vtfs_sb_info* sbi = VTFS_SB(inode->i_sb);
+  int err = file_write_and_wait_range(filp, start, end);
+  if (!err)
+    err = vtfs_stat_call(sbi->stats, VTFS_OP_SYNC, sbi->ops->sync(inode->i_sb));
+  trace_vtfs_op_exit("fsync", ino, err, trace_start);
+  return err;
+}
+
+int vtfs_sync_fs(struct super_block* sb, int wait) {
+  struct vtfs_sb_info* sbi = VTFS_SB(sb);
+  return wait ? vtfs_stat_call(sbi->stats, VTFS_OP_SYNC, sbi->ops->sync(sb)) : 0;
 }
 
 int vtfs_link(struct dentry* old_dentry, struct inode* parent_inode, struct dentry* new_dentry) {
   struct inode* old_inode = d_inode(old_dentry);
+  const char* name = new_dentry->d_name.name;
   struct vtfs_node_meta meta;
-  int err =
-      vtfs_storage_link(parent_inode->i_ino, new_dentry->d_name.name, old_inode->i_ino, &meta);
-  if (err) {
-    return err;
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("link", old_inode->i_ino, name, 0, 0);
+
+  struct vtfs_sb_info* sbi = VTFS_SB(parent_inode->i_sb);
+  int err = vtfs_stat_call(
+      sbi->stats,
+      VTFS_OP_LINK,
+      sbi->ops->link(parent_inode->i_sb, parent_inode->i_ino, name, old_inode->i_ino, &meta)
+  );
+  if (!err) {
+    ihold(old_inode);
+    vtfs_dentry_verified(new_dentry);
+    d_instantiate(new_dentry, old_inode);
+    // i_size is left alone, the backend doesn't have what is still dirty in the page cache
+    set_nlink(old_inode, meta.nlink);
   }
 
-  ihold(old_inode);
-  d_instantiate(new_dentry, old_inode);
-  old_inode->i_size = meta.size;
-  set_nlink(old_inode, meta.nlink);
-  return 0;
+  trace_vtfs_op_exit("link", old_inode->i_ino, err, start);
+  return err;
 }
 
-int vtfs_setattr(struct mnt_idmap* idmap, struct dentry* dentry, struct iattr* attr) {
+static int vtfs_do_setattr(struct mnt_idmap* idmap, struct dentry* dentry, struct iattr* attr) {
   struct inode* inode = d_inode(dentry);
+  struct vtfs_sb_info* sbi = VTFS_SB(inode->i_sb);
   int err;
 
   err = setattr_prepare(idmap, dentry, attr);
@@ -348,22 +1666,29 @@ int vtfs_setattr(struct mnt_idmap* idmap, struct dentry* dentry, struct iattr* a
   if (attr->ia_valid & ATTR_SIZE) {
     loff_t new_size = attr->ia_size;
 
-    LOG("truncate inode=%lu to size=%lld\n", inode->i_ino, new_size);
-
-    err = vtfs_storage_truncate(inode->i_ino, new_size);
+    // what the truncate drops from the page cache is written back first, so a failed truncate
+    // loses nothing; the invalidate lock keeps mapped writes from dirtying it again before the
+    // cached pages go, and their writeback from landing past the truncate in the backend
+    filemap_invalidate_lock(inode->i_mapping);
+    err = filemap_write_and_wait_range(inode->i_mapping, new_size, LLONG_MAX);
+    if (!err)
+      err = vtfs_stat_call(
+          sbi->stats, VTFS_OP_TRUNCATE, sbi->ops->truncate(inode->i_sb, inode->i_ino, new_size)
+      );
+    if (!err)
+      truncate_setsize(inode, new_size);
+    filemap_invalidate_unlock(inode->i_mapping);
     if (err)
       return err;
-
-    inode->i_size = new_size;
   }
 
   // --- chmod ---
   if (attr->ia_valid & ATTR_MODE) {
     umode_t new_mode = attr->ia_mode & 0777;
 
-    LOG("chmod inode=%lu mode=%o\n", inode->i_ino, new_mode);
-
-    err = vtfs_storage_chmod(inode->i_ino, new_mode);
+    err = vtfs_stat_call(
+        sbi->stats, VTFS_OP_CHMOD, sbi->ops->chmod(inode->i_sb, inode->i_ino, new_mode)
+    );
     if (err)
       return err;
 
@@ -375,5 +1700,16 @@ int vtfs_setattr(struct mnt_idmap* idmap, struct dentry* dentry, struct iattr* a
   return 0;
 }
 
+int vtfs_setattr(struct mnt_idmap* idmap, struct dentry* dentry, struct iattr* attr) {
+  unsigned long ino = d_inode(dentry)->i_ino;
+  loff_t size = attr->ia_valid & ATTR_SIZE ? attr->ia_size : 0;
+  u64 start = vtfs_trace_start(vtfs_op_exit);
+  trace_vtfs_op_enter("setattr", ino, NULL, size, 0);
+
+  int err = vtfs_do_setattr(idmap, dentry, attr);
+  trace_vtfs_op_exit("setattr", ino, err, start);
+  return err;
+}
+
 module_init(vtfs_init);
 module_exit(vtfs_exit);
\ No newline at end of file
@@ -2,14 +2,59 @@
 #define _VTFS_H
 
 #include <linux/fs.h>
+#include <linux/ioctl.h>
 
 #define MODULE_NAME "vtfs"
+#define VTFS_MAGIC 0x76746673
+
+// writes the tree of a RAM backend mount to the image given by its image= option
+#define VTFS_IOC_CHECKPOINT _IO('v', 1)
+
 #define LOG(fmt, ...) pr_info("[" MODULE_NAME "]: " fmt, ##__VA_ARGS__)
 
+struct vtfs_backend_ops;
+struct vtfs_node_meta;
+struct vtfs_stats;
+
+// per-mount state, in sb->s_fs_info
+struct vtfs_sb_info {
+  const struct vtfs_backend_ops* ops;
+  void* storage;  // the backend's own per-mount state, see vtfs_backend_ops
+  bool remote;  // VTFS_STORAGE_REMOTE, cached attributes and dentries expire
+  // attribute lifetimes in jiffies; a lifetime doubles from min to max while the attributes
+  // stay the same, dentries live as long as their parent's attributes
+  unsigned long acregmin;
+  unsigned long acregmax;
+  unsigned long acdirmin;
+  unsigned long acdirmax;
+  unsigned long negtimeo;  // of cached misses
+  struct vtfs_stats __percpu* stats;
+  struct dentry* debugfs_dir;  // vtfs/<major:minor>/ in debugfs
+};
+
+struct vtfs_inode_info {
+  struct inode vfs_inode;
+  unsigned long attr_time;  // jiffies the attributes were last taken from the backend
+  unsigned long attr_ttl;
+};
+
+static inline struct vtfs_sb_info* VTFS_SB(const struct super_block* sb) {
+  return sb->s_fs_info;
+}
+
+static inline struct vtfs_inode_info* VTFS_I(const struct inode* inode) {
+  return container_of(inode, struct vtfs_inode_info, vfs_inode);
+}
+
 extern struct file_system_type vtfs_fs_type;
 extern struct inode_operations vtfs_inode_ops;
 extern struct file_operations vtfs_dir_ops;
 extern struct file_operations vtfs_file_ops;
+extern const struct address_space_operations vtfs_aops;
+extern const struct super_operations vtfs_super_ops;
+extern const struct dentry_operations vtfs_dentry_ops;
+extern struct dentry* vtfs_debugfs_root;
+extern const struct fs_parameter_spec vtfs_fs_parameters[];
 
 struct dentry* vtfs_lookup(
     struct inode* parent_inode, struct dentry* child_dentry, unsigned int flag
@@ -31,16 +76,32 @@ int vtfs_open(struct inode* inode, struct file* filp);
 
 int vtfs_release(struct inode* inode, struct file* filp);
 
-struct dentry* vtfs_mount(
-    struct file_system_type* fs_type, int flags, const char* token, void* data
-);
+int vtfs_init_fs_context(struct fs_context* fc);
 
-int vtfs_fill_super(struct super_block* sb, void* data, int silent);
+int vtfs_fill_super(struct super_block* sb, struct fs_context* fc);
 
 void vtfs_kill_sb(struct super_block* sb);
 
+int vtfs_statfs(struct dentry* dentry, struct kstatfs* buf);
+
+struct inode* vtfs_alloc_inode(struct super_block* sb);
+
+void vtfs_free_inode(struct inode* inode);
+
+int vtfs_d_revalidate(
+    struct inode* dir, const struct qstr* name, struct dentry* dentry, unsigned int flags
+);
+
+int vtfs_getattr(
+    struct mnt_idmap* idmap,
+    const struct path* path,
+    struct kstat* stat,
+    u32 request_mask,
+    unsigned int query_flags
+);
+
 struct inode* vtfs_get_inode(
-    struct super_block* sb, const struct inode* dir, umode_t mode, int i_ino
+    struct super_block* sb, const struct inode* dir, const struct vtfs_node_meta* meta
 );
 
 struct dentry* vtfs_mkdir(
@@ -49,12 +110,73 @@ struct dentry* vtfs_mkdir(
 
 int vtfs_rmdir(struct inode* parent_inode, struct dentry* child_dentry);
 
-ssize_t vtfs_read(struct file* filp, char __user* buffer, size_t len, loff_t* offset);
+void vtfs_evict_inode(struct inode* inode);
+
+int vtfs_read_folio(struct file* file, struct folio* folio);
+
+void vtfs_readahead(struct readahead_control* rac);
+
+int vtfs_write_begin(
+    const struct kiocb* iocb,
+    struct address_space* mapping,
+    loff_t pos,
+    unsigned int len,
+    struct folio** foliop,
+    void** fsdata
+);
+
+int vtfs_write_end(
+    const struct kiocb* iocb,
+    struct address_space* mapping,
+    loff_t pos,
+    unsigned int len,
+    unsigned int copied,
+    struct folio* folio,
+    void* fsdata
+);
+
+int vtfs_writepages(struct address_space* mapping, struct writeback_control* wbc);
+
+ssize_t vtfs_file_read_iter(struct kiocb* iocb, struct iov_iter* to);
+
+ssize_t vtfs_file_write_iter(struct kiocb* iocb, struct iov_iter* from);
+
+int vtfs_mmap(struct file* file, struct vm_area_struct* vma);
+
+ssize_t vtfs_splice_read(
+    struct file* in, loff_t* ppos, struct pipe_inode_info* pipe, size_t len, unsigned int flags
+);
+
+vm_fault_t vtfs_page_mkwrite(struct vm_fault* vmf);
+
+loff_t vtfs_llseek(struct file* filp, loff_t offset, int whence);
+
+loff_t vtfs_remap_file_range(
+    struct file* file_in,
+    loff_t pos_in,
+    struct file* file_out,
+    loff_t pos_out,
+    loff_t len,
+    unsigned int remap_flags
+);
 
-ssize_t vtfs_write(struct file* filp, const char __user* buffer, size_t len, loff_t* offset);
+ssize_t vtfs_copy_file_range(
+    struct file* file_in,
+    loff_t pos_in,
+    struct file* file_out,
+    loff_t pos_out,
+    size_t len,
+    unsigned int flags
+);
 
 int vtfs_link(struct dentry* old_dentry, struct inode* parent_inode, struct dentry* new_dentry);
 
+long vtfs_ioctl(struct file* filp, unsigned int cmd, unsigned long arg);
+
+int vtfs_fsync(struct file* filp, loff_t start, loff_t end, int datasync);
+
+int vtfs_sync_fs(struct super_block* sb, int wait);
+
 int vtfs_setattr(struct mnt_idmap* idmap, struct dentry* dentry, struct iattr* attr);
 
 #endif
\ No newline at end of file
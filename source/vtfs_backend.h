@@ -1,6 +1,7 @@
 #ifndef _VTFS_BACKEND_H
 #define _VTFS_BACKEND_H
 #include <linux/fs.h>
+#include <linux/indirect_call_wrapper.h>
 
 typedef ino_t vtfs_ino_t;
 
@@ -18,46 +19,202 @@ struct vtfs_node_meta {
   nlink_t nlink;
 };
 
+// VTFS_OPT_UNSET keeps the backend's current value, 0 means unlimited
+#define VTFS_OPT_UNSET U64_MAX
+
+// strings are NULL when unset
+struct vtfs_mount_opts {
+  u64 max_bytes;
+  u64 max_inodes;
+  const char* server;  // "a.b.c.d[:port]" of a remote backend
+  const char* token;
+  u64 rpc_chunk;      // most bytes moved by one read or write request
+  u64 conns;          // idle connections kept open, 0 closes each after its request
+  const char* image;  // absolute path of the checkpoint image of a local backend
+  const char* wal;    // absolute path of its write-ahead log
+};
+
 struct vtfs_dirent {
   char name[NAME_MAX + 1];
   vtfs_ino_t ino;
   enum vtfs_node_type type;
 };
 
-int vtfs_storage_init(void);
-
-void vtfs_storage_shutdown(void);
-
-int vtfs_storage_get_root(struct vtfs_node_meta* out);
-
-int vtfs_storage_lookup(vtfs_ino_t parent, const char* name, struct vtfs_node_meta* out);
-
-int vtfs_storage_iterate_dir(vtfs_ino_t dir_ino, unsigned long* offset, struct vtfs_dirent* out);
-
-int vtfs_storage_create_file(
-    vtfs_ino_t parent, const char* name, umode_t mode, struct vtfs_node_meta* out
-);
-
-int vtfs_storage_unlink(vtfs_ino_t parent, const char* name);
-
-int vtfs_storage_mkdir(
-    vtfs_ino_t parent, const char* name, umode_t mode, struct vtfs_node_meta* out
-);
-
-int vtfs_storage_rmdir(vtfs_ino_t parent, const char* name);
-
-ssize_t vtfs_storage_read_file(vtfs_ino_t ino, loff_t offset, size_t len, char* dst);
-
-ssize_t vtfs_storage_write_file(
-    vtfs_ino_t ino, loff_t offset, const char* src, size_t len, loff_t* new_size
-);
-
-int vtfs_storage_link(
-    vtfs_ino_t parent, const char* name, vtfs_ino_t target_ino, struct vtfs_node_meta* out
-);
+struct vtfs_dirent_plus {
+  struct vtfs_dirent ent;
+  struct vtfs_node_meta meta;
+  unsigned long next;  // resume position past this entry
+};
 
-int vtfs_storage_truncate(vtfs_ino_t ino, loff_t size);
+// the tree can change without going through this module, e.g. from another client of the
+// server; the VFS caches of a mount then expire instead of being trusted
+#define VTFS_STORAGE_REMOTE (1U << 0)
+
+// the backend keeps file data in memory already; read and write go straight to it, the page
+// cache would only hold a second copy. It is still used for the pages of mapped files.
+#define VTFS_STORAGE_NOCACHE (1U << 1)
+
+// a storage backend, picked per mount with the backend= option; both are linked in and
+// initialized at module load. Every call below fill_super works on the mount sb, a backend
+// keeps what belongs to a mount in VTFS_SB(sb)->storage.
+struct vtfs_backend_ops {
+  const char* name;
+  unsigned int flags;  // VTFS_STORAGE_*
+
+  int (*init)(void);
+
+  void (*shutdown)(void);
+
+  // sets up the backend's state of a new mount and applies its options; cleans up after itself
+  // when it fails
+  int (*fill_super)(struct super_block* sb, const struct vtfs_mount_opts* opts);
+
+  // frees what fill_super set up, once the VFS is done with the mount; also called when
+  // fill_super or a later step of the mount failed
+  void (*kill_sb)(struct super_block* sb);
+
+  // the VFS evicted its inode for ino; called for every inode it drops. A backend that hands
+  // out inos keeps the one of an inode whose last link is gone allocated until then, the data
+  // paths of its still open files reach it by ino.
+  void (*evict)(struct super_block* sb, vtfs_ino_t ino);
+
+  // applies mount options on remount; -EINVAL if a limit is below current usage or an option
+  // doesn't apply to the backend
+  int (*configure)(struct super_block* sb, const struct vtfs_mount_opts* opts);
+
+  // -EOPNOTSUPP if the backend doesn't track capacity
+  int (*statfs)(struct super_block* sb, struct kstatfs* buf);
+
+  int (*get_root)(struct super_block* sb, struct vtfs_node_meta* out);
+
+  int (*lookup)(
+      struct super_block* sb, vtfs_ino_t parent, const char* name, struct vtfs_node_meta* out
+  );
+
+  // *offset is an opaque resume position (0 starts the listing) advanced past the returned
+  // entry; returns 0 with an entry in *out, 1 at the end of the directory or a negative errno
+  int (*iterate_dir)(
+      struct super_block* sb, vtfs_ino_t dir_ino, unsigned long* offset, struct vtfs_dirent* out
+  );
+
+  // lists up to max entries from offset together with their attributes; returns how many, 0 at
+  // the end of the directory. -EOPNOTSUPP if the backend only lists an entry at a time
+  int (*iterate_dir_plus)(
+      struct super_block* sb,
+      vtfs_ino_t dir_ino,
+      unsigned long offset,
+      struct vtfs_dirent_plus* out,
+      int max
+  );
+
+  int (*create_file)(
+      struct super_block* sb,
+      vtfs_ino_t parent,
+      const char* name,
+      umode_t mode,
+      struct vtfs_node_meta* out
+  );
+
+  int (*unlink)(struct super_block* sb, vtfs_ino_t parent, const char* name);
+
+  int (*mkdir)(
+      struct super_block* sb,
+      vtfs_ino_t parent,
+      const char* name,
+      umode_t mode,
+      struct vtfs_node_meta* out
+  );
+
+  int (*rmdir)(struct super_block* sb, vtfs_ino_t parent, const char* name);
+
+  ssize_t (*read_file)(
+      struct super_block* sb, vtfs_ino_t ino, loff_t offset, size_t len, char* dst
+  );
+
+  ssize_t (*write_file)(
+      struct super_block* sb,
+      vtfs_ino_t ino,
+      loff_t offset,
+      const char* src,
+      size_t len,
+      loff_t* new_size
+  );
+
+  // like read_file/write_file, but straight from/into an iov_iter in bounded chunks, without a
+  // buffer of the whole length; reads are short only at EOF. Returns the number of bytes
+  // copied, the iterator is advanced by that much.
+  ssize_t (*read_iter)(struct super_block* sb, vtfs_ino_t ino, loff_t offset, struct iov_iter* to);
+
+  ssize_t (*write_iter)(
+      struct super_block* sb, vtfs_ino_t ino, loff_t offset, struct iov_iter* from, loff_t* new_size
+  );
+
+  // hands references to the stored pages at *ppos to the pipe, advancing *ppos; -EOPNOTSUPP if
+  // the backend doesn't keep file data in pages
+  ssize_t (*splice_read)(
+      struct super_block* sb, vtfs_ino_t ino, loff_t* ppos, struct pipe_inode_info* pipe, size_t len
+  );
+
+  int (*link)(
+      struct super_block* sb,
+      vtfs_ino_t parent,
+      const char* name,
+      vtfs_ino_t target_ino,
+      struct vtfs_node_meta* out
+  );
+
+  int (*truncate)(struct super_block* sb, vtfs_ino_t ino, loff_t size);
+
+  // copies len bytes from src at src_off into dst at dst_off, stopping at the end of src;
+  // returns the number of bytes copied. Backends may share data between the files instead of
+  // copying it, which always happens for page aligned ranges in the RAM backend. -EOPNOTSUPP
+  // if the backend can only copy through read/write.
+  ssize_t (*copy_range)(
+      struct super_block* sb,
+      vtfs_ino_t src_ino,
+      loff_t src_off,
+      vtfs_ino_t dst_ino,
+      loff_t dst_off,
+      size_t len,
+      loff_t* new_size
+  );
+
+  int (*chmod)(struct super_block* sb, vtfs_ino_t ino, umode_t mode);
+
+  // writes a consistent image of the mount's tree to its image= location; -EOPNOTSUPP if the
+  // backend keeps its data elsewhere already
+  int (*checkpoint)(struct super_block* sb);
+
+  // makes every change made so far durable; 0 right away if the backend has nothing to flush
+  int (*sync)(struct super_block* sb);
+
+  // SEEK_DATA/SEEK_HOLE: stores the start of the next data region/hole at or after offset in
+  // *out; -ENXIO past EOF, -EOPNOTSUPP if the backend doesn't track holes
+  int (*seek_data)(struct super_block* sb, vtfs_ino_t ino, loff_t offset, int whence, loff_t* out);
+};
 
-int vtfs_storage_chmod(vtfs_ino_t ino, umode_t mode);
+extern const struct vtfs_backend_ops vtfs_ram_backend_ops;
+extern const struct vtfs_backend_ops vtfs_lavnetfs_backend_ops;
+
+// the hot path reaches these through INDIRECT_CALL_2, a compare and a direct call instead of
+// an indirect one
+INDIRECT_CALLABLE_DECLARE(int vtfs_ram_lookup(
+    struct super_block* sb, vtfs_ino_t parent, const char* name, struct vtfs_node_meta* out
+));
+INDIRECT_CALLABLE_DECLARE(int vtfs_lavnetfs_lookup(
+    struct super_block* sb, vtfs_ino_t parent, const char* name, struct vtfs_node_meta* out
+));
+INDIRECT_CALLABLE_DECLARE(ssize_t vtfs_ram_read_iter(
+    struct super_block* sb, vtfs_ino_t ino, loff_t offset, struct iov_iter* to
+));
+INDIRECT_CALLABLE_DECLARE(ssize_t vtfs_lavnetfs_read_iter(
+    struct super_block* sb, vtfs_ino_t ino, loff_t offset, struct iov_iter* to
+));
+INDIRECT_CALLABLE_DECLARE(ssize_t vtfs_ram_write_iter(
+    struct super_block* sb, vtfs_ino_t ino, loff_t offset, struct iov_iter* from, loff_t* new_size
+));
+INDIRECT_CALLABLE_DECLARE(ssize_t vtfs_lavnetfs_write_iter(
+    struct super_block* sb, vtfs_ino_t ino, loff_t offset, struct iov_iter* from, loff_t* new_size
+));
 
 #endif
\ No newline at end of file
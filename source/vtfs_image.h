@@ -0,0 +1,89 @@
+#ifndef _VTFS_IMAGE_H
+#define _VTFS_IMAGE_H
+#include <linux/types.h>
+
+/*
+ * Checkpoint image of the RAM backend, all fields little endian:
+ *
+ *   header page | data segment | metadata
+ *
+ * The data segment holds every distinct data page once, in page-sized slots; pages shared
+ * between files are written a single time and holes are not written at all. The metadata
+ * lists every inode followed by its page map, and then every directory entry.
+ *
+ * Checkpoints alternate between two files, so the previous image stays intact until the new
+ * one is complete; restore picks the valid image with the highest generation.
+ */
+#define VTFS_IMAGE_MAGIC 0x31474d4953465456ULL  // "VTFSIMG1"
+#define VTFS_IMAGE_VERSION 1
+
+struct vtfs_image_header {
+  __le64 magic;
+  __le32 version;
+  __le32 page_size;
+  __le64 nr_inodes;
+  __le64 nr_dirents;
+  __le64 nr_slots;  // pages in the data segment
+  __le64 data_off;
+  __le64 meta_off;
+  __le64 meta_len;
+  // fields below read as zero in images written before they existed, the header page is
+  // zero-filled
+  __le64 generation;
+  __le64 wal_seq;  // last write-ahead log record the image includes
+};
+
+struct vtfs_image_inode {
+  __le64 ino;
+  __le64 size;
+  __le64 nr_pages;  // vtfs_image_page records that follow
+  __le32 mode;
+  __le32 nlink;
+  __le32 type;
+  __le32 reserved;
+};
+
+struct vtfs_image_page {
+  __le64 index;  // page index in the file
+  __le64 slot;   // page index in the data segment
+};
+
+struct vtfs_image_dirent {
+  __le64 parent_ino;
+  __le64 ino;
+  __le16 name_len;
+  char name[];  // not NUL terminated
+} __packed;
+
+/*
+ * Write-ahead log: a sequence of records, each a vtfs_wal_record followed by the name and then
+ * the data. seq numbers are consecutive; a record that is cut short or fails its crc ends the
+ * log, it was never reported as durable.
+ */
+enum vtfs_wal_op {
+  VTFS_WAL_CREATE = 1,  // ino, parent_ino, name, mode
+  VTFS_WAL_MKDIR,       // ino, parent_ino, name, mode
+  VTFS_WAL_UNLINK,      // parent_ino, name
+  VTFS_WAL_RMDIR,       // parent_ino, name
+  VTFS_WAL_LINK,        // ino, parent_ino, name
+  VTFS_WAL_TRUNCATE,    // ino, pos = new size
+  VTFS_WAL_CHMOD,       // ino, mode
+  VTFS_WAL_WRITE,       // ino, pos, data
+  VTFS_WAL_COPY,        // ino, pos, src_ino, src_pos, count
+};
+
+struct vtfs_wal_record {
+  __le32 crc;  // crc32 of the whole record past this field
+  __le32 len;  // of the whole record
+  __le64 seq;
+  __le64 ino;
+  __le64 parent_ino;  // src_ino for VTFS_WAL_COPY
+  __le64 pos;
+  __le64 src_pos;
+  __le64 count;
+  __le32 mode;
+  __le16 op;
+  __le16 name_len;
+};
+
+#endif
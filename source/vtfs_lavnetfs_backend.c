@@ -2,68 +2,67 @@
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/uio.h>
 
 #include "http.h"
 #include "vtfs.h"
 #include "vtfs_backend.h"
 
-#define VTFS_TOKEN "devtoken"
+// used unless the mount says otherwise
+#define VTFS_DEFAULT_SERVER "127.0.0.1:5005"
+#define VTFS_DEFAULT_TOKEN "devtoken"
 
-/* --- helpers --- */
+// most a single read/write request moves through read_iter/write_iter, the rpc_chunk= option
+#define VTFS_IO_CHUNK (64 * 1024)
+#define VTFS_IO_CHUNK_MAX (16 * 1024 * 1024)
 
-static int vtfs_call(const char* method, char* resp, size_t resp_size, size_t argc, ...) {
-  va_list args;
-  va_start(args, argc);
-  int64_t ret = vtfs_http_call(VTFS_TOKEN, method, resp, resp_size, argc, args);
-  va_end(args);
+// one mount of the lavnetfs backend, in vtfs_sb_info->storage
+struct vtfs_lavnetfs_fs {
+  struct vtfs_http_client* http;
+  size_t io_chunk;
+};
 
-  if (ret < 0) {
-    return (int)ret;
-  }
-
-  return 0;
+static inline struct vtfs_lavnetfs_fs* VTFS_NET(struct super_block* sb) {
+  return VTFS_SB(sb)->storage;
 }
 
+// an iterate_dir_plus entry as the server sends it
+struct vtfs_wire_dirent_plus {
+  struct vtfs_dirent ent;
+  struct vtfs_node_meta meta;
+};
+
 /* --- lifecycle --- */
 
-int vtfs_storage_init(void) {
+static int vtfs_lavnetfs_init(void) {
   printk(KERN_INFO "vtfs_lavnetfs: init\n");
   return 0;
 }
 
-void vtfs_storage_shutdown(void) {
+static void vtfs_lavnetfs_shutdown(void) {
   printk(KERN_INFO "vtfs_lavnetfs: shutdown\n");
 }
 
+
 /* --- root --- */
 
-int vtfs_storage_get_root(struct vtfs_node_meta* out) {
-  LOG("getting root...");
+static int vtfs_lavnetfs_get_root(struct super_block* sb, struct vtfs_node_meta* out) {
   char buf[sizeof(struct vtfs_node_meta)];
-  int ret = vtfs_http_call(VTFS_TOKEN, "get_root", buf, sizeof(buf), 0);
-
-  LOG("ret: %d", ret);
+  int ret = vtfs_http_call(VTFS_NET(sb)->http, "get_root", buf, sizeof(buf), NULL, 0);
 
   if (ret < 0) {
     return (int)ret;
   }
 
   memcpy(out, buf, sizeof(*out));
-
-  LOG("got root\n");
-  LOG("ino=%d\n", out->ino);
-  LOG("parent_ino=%d\n", out->parent_ino);
-  LOG("type=%d\n", out->type);
-  LOG("mode=%d\n", out->mode);
-  LOG("size=%d\n", out->size);
-  LOG("nlink=%d\n", out->nlink);
-
   return 0;
 }
 
 /* --- lookup --- */
 
-int vtfs_storage_lookup(vtfs_ino_t parent, const char* name, struct vtfs_node_meta* out) {
+INDIRECT_CALLABLE_SCOPE int vtfs_lavnetfs_lookup(
+    struct super_block* sb, vtfs_ino_t parent, const char* name, struct vtfs_node_meta* out
+) {
   char buf[sizeof(struct vtfs_node_meta)];
   char parent_buf[32];
   char name_enc[256];
@@ -72,30 +71,51 @@ int vtfs_storage_lookup(vtfs_ino_t parent, const char* name, struct vtfs_node_me
   encode(name, name_enc);
 
   int ret = vtfs_http_call(
-      VTFS_TOKEN, "lookup", buf, sizeof(buf), 2, "parent", parent_buf, "name", name_enc
+      VTFS_NET(sb)->http,
+      "lookup",
+      buf,
+      sizeof(buf),
+      NULL,
+      2,
+      "parent",
+      parent_buf,
+      "name",
+      name_enc
   );
 
   if (ret < 0) {
     return (int)ret;
   }
+  if (ret > 0) {
+    return -ENOENT;  // the server's own error code, there is no such entry
+  }
 
   memcpy(out, buf, sizeof(*out));
   return 0;
 }
 
-int vtfs_storage_iterate_dir(vtfs_ino_t dir_ino, unsigned long* offset, struct vtfs_dirent* out) {
+static int vtfs_lavnetfs_iterate_dir(
+    struct super_block* sb, vtfs_ino_t dir_ino, unsigned long* offset, struct vtfs_dirent* out
+) {
   if (!offset || !out)
     return -EINVAL;
 
-  LOG("iterating dir_ino=%lu, offset=%lu...\n", dir_ino, *offset);
-
   char dir_ino_buf[32], offset_buf[32];
   snprintf(dir_ino_buf, sizeof(dir_ino_buf), "%lu", dir_ino);
   snprintf(offset_buf, sizeof(offset_buf), "%lu", *offset);
 
   char resp[512];
   int64_t ret = vtfs_http_call(
-      VTFS_TOKEN, "iterate_dir", resp, sizeof(resp), 2, "dir_ino", dir_ino_buf, "offset", offset_buf
+      VTFS_NET(sb)->http,
+      "iterate_dir",
+      resp,
+      sizeof(resp),
+      NULL,
+      2,
+      "dir_ino",
+      dir_ino_buf,
+      "offset",
+      offset_buf
   );
 
   if (ret < 0) {
@@ -115,19 +135,93 @@ int vtfs_storage_iterate_dir(vtfs_ino_t dir_ino, unsigned long* offset, struct v
   }
 
   if (empty) {
-    LOG("directory ended\n");
     return 1;  // end of dir
   }
 
   memcpy(out, payload, sizeof(*out));
   (*offset)++;
 
-  LOG("got dirent ino=%u name=%s type=%d\n", out->ino, out->name, out->type);
   return 0;
 }
 
-int vtfs_storage_create_file(
-    vtfs_ino_t parent, const char* name, umode_t mode, struct vtfs_node_meta* out
+static int vtfs_lavnetfs_iterate_dir_plus(
+    struct super_block* sb,
+    vtfs_ino_t dir_ino,
+    unsigned long offset,
+    struct vtfs_dirent_plus* out,
+    int max
+) {
+  char dir_ino_buf[32], offset_buf[32], count_buf[32];
+  snprintf(dir_ino_buf, sizeof(dir_ino_buf), "%lu", dir_ino);
+  snprintf(offset_buf, sizeof(offset_buf), "%lu", offset);
+  snprintf(count_buf, sizeof(count_buf), "%d", max);
+
+  /* resp = [u64 count][count * (vtfs_dirent, vtfs_node_meta)] */
+  size_t resp_size = sizeof(uint64_t) + max * sizeof(struct vtfs_wire_dirent_plus);
+  char* resp = kmalloc(resp_size, GFP_KERNEL);
+  if (!resp) {
+    return -ENOMEM;
+  }
+
+  size_t got = 0;
+  int64_t ret = vtfs_http_call(
+      VTFS_NET(sb)->http,
+      "iterate_dir_plus",
+      resp,
+      resp_size,
+      &got,
+      3,
+      "dir_ino",
+      dir_ino_buf,
+      "offset",
+      offset_buf,
+      "count",
+      count_buf
+  );
+
+  // a server without the method fails with -EOPNOTSUPP and passes it on, any error code of
+  // its own is -EIO
+  if (ret > 0) {
+    ret = -EIO;
+  }
+  if (ret < 0) {
+    kfree(resp);
+    return (int)ret;
+  }
+
+  // the count is the server's word; hold it to what actually arrived, which never exceeds max
+  // entries since resp has room for no more
+  uint64_t count = 0;
+  if (got < sizeof(uint64_t)) {
+    kfree(resp);
+    return -EIO;
+  }
+  memcpy(&count, resp, sizeof(uint64_t));
+  if (count > (got - sizeof(uint64_t)) / sizeof(struct vtfs_wire_dirent_plus)) {
+    kfree(resp);
+    return -EIO;
+  }
+
+  for (int i = 0; i < count; i++) {
+    struct vtfs_wire_dirent_plus wire;
+    memcpy(&wire, resp + sizeof(uint64_t) + i * sizeof(wire), sizeof(wire));
+
+    out[i].ent = wire.ent;
+    out[i].ent.name[NAME_MAX] = '\0';
+    out[i].meta = wire.meta;
+    out[i].next = offset + i + 1;
+  }
+
+  kfree(resp);
+  return (int)count;
+}
+
+static int vtfs_lavnetfs_create_file(
+    struct super_block* sb,
+    vtfs_ino_t parent,
+    const char* name,
+    umode_t mode,
+    struct vtfs_node_meta* out
 ) {
   if (!name || !out) {
     return -EINVAL;
@@ -140,13 +234,12 @@ int vtfs_storage_create_file(
   snprintf(parent_buf, sizeof(parent_buf), "%lu", parent);
   snprintf(mode_buf, sizeof(mode_buf), "%u", mode);
 
-  LOG("creating file '%s' under parent=%lu with mode=0%o\n", name, parent, mode);
-
   int64_t ret = vtfs_http_call(
-      VTFS_TOKEN,
+      VTFS_NET(sb)->http,
       "create",
       resp,
       sizeof(resp),
+      NULL,
       3,
       "parent",
       parent_buf,
@@ -163,11 +256,10 @@ int vtfs_storage_create_file(
 
   memcpy(out, resp, sizeof(*out));
 
-  LOG("file created: ino=%u name=%s\n", out->ino, name);
   return 0;
 }
 
-int vtfs_storage_unlink(vtfs_ino_t parent, const char* name) {
+static int vtfs_lavnetfs_unlink(struct super_block* sb, vtfs_ino_t parent, const char* name) {
   if (!name) {
     return -EINVAL;
   }
@@ -177,10 +269,17 @@ int vtfs_storage_unlink(vtfs_ino_t parent, const char* name) {
 
   snprintf(parent_buf, sizeof(parent_buf), "%lu", parent);
 
-  LOG("unlinking file '%s' under parent=%lu\n", name, parent);
-
   int64_t ret = vtfs_http_call(
-      VTFS_TOKEN, "unlink", resp, sizeof(resp), 2, "parent", parent_buf, "name", (char*)name
+      VTFS_NET(sb)->http,
+      "unlink",
+      resp,
+      sizeof(resp),
+      NULL,
+      2,
+      "parent",
+      parent_buf,
+      "name",
+      (char*)name
   );
 
   if (ret < 0) {
@@ -188,12 +287,15 @@ int vtfs_storage_unlink(vtfs_ino_t parent, const char* name) {
     return (int)ret;
   }
 
-  LOG("file unlinked\n");
   return 0;
 }
 
-int vtfs_storage_mkdir(
-    vtfs_ino_t parent, const char* name, umode_t mode, struct vtfs_node_meta* out
+static int vtfs_lavnetfs_mkdir(
+    struct super_block* sb,
+    vtfs_ino_t parent,
+    const char* name,
+    umode_t mode,
+    struct vtfs_node_meta* out
 ) {
   if (!name || !out) {
     return -EINVAL;
@@ -206,13 +308,12 @@ int vtfs_storage_mkdir(
   snprintf(parent_buf, sizeof(parent_buf), "%lu", parent);
   snprintf(mode_buf, sizeof(mode_buf), "%u", mode);
 
-  LOG("creating directory '%s' under parent=%lu with mode=0%o\n", name, parent, mode);
-
   int64_t ret = vtfs_http_call(
-      VTFS_TOKEN,
+      VTFS_NET(sb)->http,
       "mkdir",
       resp,
       sizeof(resp),
+      NULL,
       3,
       "parent",
       parent_buf,
@@ -229,11 +330,10 @@ int vtfs_storage_mkdir(
 
   memcpy(out, resp, sizeof(*out));
 
-  LOG("dir created: ino=%lu name=%s\n", out->ino, name);
   return 0;
 }
 
-int vtfs_storage_rmdir(vtfs_ino_t parent, const char* name) {
+static int vtfs_lavnetfs_rmdir(struct super_block* sb, vtfs_ino_t parent, const char* name) {
   if (!name) {
     return -EINVAL;
   }
@@ -243,10 +343,17 @@ int vtfs_storage_rmdir(vtfs_ino_t parent, const char* name) {
 
   snprintf(parent_buf, sizeof(parent_buf), "%lu", parent);
 
-  LOG("rmdir dir '%s' under parent=%lu\n", name, parent);
-
   int64_t ret = vtfs_http_call(
-      VTFS_TOKEN, "rmdir", resp, sizeof(resp), 2, "parent", parent_buf, "name", (char*)name
+      VTFS_NET(sb)->http,
+      "rmdir",
+      resp,
+      sizeof(resp),
+      NULL,
+      2,
+      "parent",
+      parent_buf,
+      "name",
+      (char*)name
   );
 
   if (ret < 0) {
@@ -254,11 +361,12 @@ int vtfs_storage_rmdir(vtfs_ino_t parent, const char* name) {
     return (int)ret;
   }
 
-  LOG("dir removed\n");
   return 0;
 }
 
-ssize_t vtfs_storage_read_file(vtfs_ino_t ino, loff_t offset, size_t len, char* dst) {
+static ssize_t vtfs_lavnetfs_read_file(
+    struct super_block* sb, vtfs_ino_t ino, loff_t offset, size_t len, char* dst
+) {
   if (!dst || len == 0)
     return -EINVAL;
 
@@ -267,12 +375,20 @@ ssize_t vtfs_storage_read_file(vtfs_ino_t ino, loff_t offset, size_t len, char*
   snprintf(offset_buf, sizeof(offset_buf), "%llu", offset);
   snprintf(len_buf, sizeof(len_buf), "%zu", len);
 
-  char resp[8192];
+  /* resp = [u64 payload_len][data] */
+  size_t resp_size = sizeof(uint64_t) + len;
+  char* resp = kvmalloc(resp_size, GFP_KERNEL);
+  if (!resp) {
+    return -ENOMEM;
+  }
+
+  size_t got = 0;
   int64_t ret = vtfs_http_call(
-      VTFS_TOKEN,
+      VTFS_NET(sb)->http,
       "read",
       resp,
-      sizeof(resp),
+      resp_size,
+      &got,
       3,
       "ino",
       ino_buf,
@@ -283,58 +399,63 @@ ssize_t vtfs_storage_read_file(vtfs_ino_t ino, loff_t offset, size_t len, char*
   );
 
   if (ret < 0) {
+    kvfree(resp);
     return (int)ret;
   }
 
   uint64_t payload_len = 0;
+  if (got < sizeof(payload_len)) {
+    kvfree(resp);
+    return -EIO;
+  }
   memcpy(&payload_len, resp, sizeof(payload_len));
-
-  LOG("payload_len=%llu\n", payload_len);
-
-  if (payload_len == 0) {
-    LOG("EOF reached\n");
-    return 0;
+  if (payload_len > got - sizeof(payload_len)) {
+    kvfree(resp);
+    return -EIO;
   }
 
   if (payload_len > len)
     payload_len = len;
 
   memcpy(dst, resp + 8, payload_len);
-  LOG("read_file ino=%lu offset=%llu read=%llu bytes\n", ino, offset, payload_len);
+  kvfree(resp);
 
   return (ssize_t)payload_len;
 }
 
-ssize_t vtfs_storage_write_file(
-    vtfs_ino_t ino, loff_t offset, const char* src, size_t len, loff_t* new_size
+static ssize_t vtfs_lavnetfs_write_file(
+    struct super_block* sb,
+    vtfs_ino_t ino,
+    loff_t offset,
+    const char* src,
+    size_t len,
+    loff_t* new_size
 ) {
   if (!src || len == 0) {
     return 0;
   }
-  LOG("write file ino=%lu, offset=%lld, len=%zu\n", ino, offset, len);
 
   char ino_buf[32], off_buf[32];
   snprintf(ino_buf, sizeof(ino_buf), "%lu", ino);
   snprintf(off_buf, sizeof(off_buf), "%llu", offset);
 
-  /* body = [data] */
-  size_t body_len = len;
-  char* body = kmalloc(body_len, GFP_KERNEL);
-  if (!body) {
-    return -ENOMEM;
-  }
-
-  memcpy(body, src, len);
-
+  /* body = [data], sent straight from src */
   char resp[32];  // written + new_size
   int64_t ret = vtfs_http_call_with_body(
-      VTFS_TOKEN, "write", body, body_len, resp, sizeof(resp), 2, "ino", ino_buf, "offset", off_buf
+      VTFS_NET(sb)->http,
+      "write",
+      src,
+      len,
+      resp,
+      sizeof(resp),
+      NULL,
+      2,
+      "ino",
+      ino_buf,
+      "offset",
+      off_buf
   );
 
-  LOG("ret=%lld\n", ret);
-
-  kfree(body);
-
   if (ret < 0) {
     return (ssize_t)ret;
   }
@@ -349,13 +470,86 @@ ssize_t vtfs_storage_write_file(
     *new_size = (loff_t)size;
   }
 
-  LOG("write_file ino=%lu off=%llu wrote=%llu new_size=%llu\n", ino, offset, written, size);
-
   return (ssize_t)written;
 }
 
-int vtfs_storage_link(
-    vtfs_ino_t parent, const char* name, vtfs_ino_t target_ino, struct vtfs_node_meta* out
+INDIRECT_CALLABLE_SCOPE ssize_t vtfs_lavnetfs_read_iter(
+    struct super_block* sb, vtfs_ino_t ino, loff_t offset, struct iov_iter* to
+) {
+  size_t chunk = min_t(size_t, iov_iter_count(to), READ_ONCE(VTFS_NET(sb)->io_chunk));
+  if (!chunk)
+    return 0;
+
+  char* buf = kmalloc(chunk, GFP_KERNEL);
+  if (!buf)
+    return -ENOMEM;
+
+  size_t done = 0;
+  ssize_t ret = 0;
+  while (iov_iter_count(to)) {
+    size_t len = min_t(size_t, iov_iter_count(to), chunk);
+    ret = vtfs_lavnetfs_read_file(sb, ino, offset + done, len, buf);
+    if (ret <= 0)
+      break;
+
+    size_t copied = copy_to_iter(buf, ret, to);
+    done += copied;
+    if (copied < ret) {
+      ret = -EFAULT;
+      break;
+    }
+  }
+
+  kfree(buf);
+  return done ? (ssize_t)done : ret;
+}
+
+INDIRECT_CALLABLE_SCOPE ssize_t vtfs_lavnetfs_write_iter(
+    struct super_block* sb, vtfs_ino_t ino, loff_t offset, struct iov_iter* from, loff_t* new_size
+) {
+  size_t chunk = min_t(size_t, iov_iter_count(from), READ_ONCE(VTFS_NET(sb)->io_chunk));
+  if (!chunk)
+    return 0;
+
+  char* buf = kmalloc(chunk, GFP_KERNEL);
+  if (!buf)
+    return -ENOMEM;
+
+  size_t done = 0;
+  ssize_t ret = 0;
+  while (iov_iter_count(from)) {
+    size_t len = copy_from_iter(buf, min_t(size_t, iov_iter_count(from), chunk), from);
+    if (!len) {
+      ret = -EFAULT;
+      break;
+    }
+
+    ret = vtfs_lavnetfs_write_file(sb, ino, offset + done, buf, len, new_size);
+    if (ret > 0)
+      done += ret;
+    if (ret < (ssize_t)len) {
+      // hand back what the server didn't take
+      iov_iter_revert(from, len - max_t(ssize_t, ret, 0));
+      break;
+    }
+  }
+
+  kfree(buf);
+  return done ? (ssize_t)done : ret;
+}
+
+static ssize_t vtfs_lavnetfs_splice_read(
+    struct super_block* sb, vtfs_ino_t ino, loff_t* ppos, struct pipe_inode_info* pipe, size_t len
+) {
+  return -EOPNOTSUPP;
+}
+
+static int vtfs_lavnetfs_link(
+    struct super_block* sb,
+    vtfs_ino_t parent,
+    const char* name,
+    vtfs_ino_t target_ino,
+    struct vtfs_node_meta* out
 ) {
   if (!name || !out) {
     return -EINVAL;
@@ -368,13 +562,12 @@ int vtfs_storage_link(
   snprintf(parent_buf, sizeof(parent_buf), "%lu", parent);
   snprintf(ino_buf, sizeof(ino_buf), "%lu", target_ino);
 
-  LOG("creating a link for ino=%lu under name=%s, parent=%lu\n", target_ino, name, parent);
-
   int64_t ret = vtfs_http_call(
-      VTFS_TOKEN,
+      VTFS_NET(sb)->http,
       "link",
       resp,
       sizeof(resp),
+      NULL,
       3,
       "parent",
       parent_buf,
@@ -390,11 +583,10 @@ int vtfs_storage_link(
 
   memcpy(out, resp, sizeof(*out));
 
-  LOG("link created: ino=%lu name=%s\n", out->ino, name);
   return 0;
 }
 
-int vtfs_storage_truncate(vtfs_ino_t ino, loff_t size) {
+static int vtfs_lavnetfs_truncate(struct super_block* sb, vtfs_ino_t ino, loff_t size) {
   char ino_buf[32];
   char size_buf[32];
   char resp[512];
@@ -402,29 +594,213 @@ int vtfs_storage_truncate(vtfs_ino_t ino, loff_t size) {
   snprintf(ino_buf, sizeof(ino_buf), "%lu", ino);
   snprintf(size_buf, sizeof(size_buf), "%lld", size);
 
-  LOG("truncating file ino=%lu to size=%lld\n", ino, size);
-
   int64_t ret = vtfs_http_call(
-      VTFS_TOKEN, "truncate", resp, sizeof(resp), 2, "ino", ino_buf, "size", size_buf
+      VTFS_NET(sb)->http, "truncate", resp, sizeof(resp), NULL, 2, "ino", ino_buf, "size", size_buf
   );
 
   if (ret < 0) {
     return (int)ret;
   }
 
-  LOG("file truncated: ino=%lu size=%lld\n", ino, size);
   return 0;
 }
 
-int vtfs_storage_chmod(vtfs_ino_t ino, umode_t mode) {
+static int vtfs_lavnetfs_chmod(struct super_block* sb, vtfs_ino_t ino, umode_t mode) {
   char ino_buf[32], mode_buf[32];
   char resp[64];
 
   snprintf(ino_buf, sizeof(ino_buf), "%lu", ino);
   snprintf(mode_buf, sizeof(mode_buf), "%u", mode & 0777);
 
-  int64_t ret =
-      vtfs_http_call(VTFS_TOKEN, "chmod", resp, sizeof(resp), 2, "ino", ino_buf, "mode", mode_buf);
+  int64_t ret = vtfs_http_call(
+      VTFS_NET(sb)->http, "chmod", resp, sizeof(resp), NULL, 2, "ino", ino_buf, "mode", mode_buf
+  );
 
   return (ret < 0) ? (int)ret : 0;
 }
+
+static ssize_t vtfs_lavnetfs_copy_range(
+    struct super_block* sb,
+    vtfs_ino_t src_ino,
+    loff_t src_off,
+    vtfs_ino_t dst_ino,
+    loff_t dst_off,
+    size_t len,
+    loff_t* new_size
+) {
+  char src_buf[32], src_off_buf[32], dst_buf[32], dst_off_buf[32], len_buf[32];
+  char resp[32];  // copied + new_size
+
+  snprintf(src_buf, sizeof(src_buf), "%lu", src_ino);
+  snprintf(src_off_buf, sizeof(src_off_buf), "%lld", src_off);
+  snprintf(dst_buf, sizeof(dst_buf), "%lu", dst_ino);
+  snprintf(dst_off_buf, sizeof(dst_off_buf), "%lld", dst_off);
+  snprintf(len_buf, sizeof(len_buf), "%zu", len);
+
+  // the server copies the whole range itself, however large
+  int64_t ret = vtfs_http_call(
+      VTFS_NET(sb)->http,
+      "copy",
+      resp,
+      sizeof(resp),
+      NULL,
+      5,
+      "src_ino",
+      src_buf,
+      "src_offset",
+      src_off_buf,
+      "dst_ino",
+      dst_buf,
+      "dst_offset",
+      dst_off_buf,
+      "len",
+      len_buf
+  );
+
+  // -EOPNOTSUPP from a server without the method lets the caller copy through read/write
+  // instead; any other failure is reported
+  if (ret < 0) {
+    return (ssize_t)ret;
+  }
+  if (ret > 0) {
+    return -EIO;  // the server's own error code, nothing was copied
+  }
+
+  uint64_t copied = 0;
+  uint64_t size = 0;
+
+  memcpy(&copied, resp, sizeof(uint64_t));
+  memcpy(&size, resp + sizeof(uint64_t), sizeof(uint64_t));
+  if (copied > len) {
+    return -EIO;
+  }
+
+  if (new_size && copied) {
+    *new_size = (loff_t)size;
+  }
+
+  return (ssize_t)copied;
+}
+
+static int vtfs_lavnetfs_checkpoint(struct super_block* sb) {
+  return -EOPNOTSUPP;
+}
+
+static int vtfs_lavnetfs_sync(struct super_block* sb) {
+  return 0;  // the server has every change once its request returns
+}
+
+static int vtfs_lavnetfs_seek_data(
+    struct super_block* sb, vtfs_ino_t ino, loff_t offset, int whence, loff_t* out
+) {
+  return -EOPNOTSUPP;
+}
+
+static int vtfs_lavnetfs_configure(struct super_block* sb, const struct vtfs_mount_opts* opts) {
+  if (opts->max_bytes != VTFS_OPT_UNSET || opts->max_inodes != VTFS_OPT_UNSET) {
+    LOG("configure: capacity limits are not supported by this backend\n");
+    return -EINVAL;
+  }
+  if (opts->image || opts->wal) {
+    LOG("configure: the server keeps the data, image= and wal= don't apply\n");
+    return -EINVAL;
+  }
+  if (opts->rpc_chunk != VTFS_OPT_UNSET &&
+      (opts->rpc_chunk < PAGE_SIZE || opts->rpc_chunk > VTFS_IO_CHUNK_MAX)) {
+    LOG("configure: rpc_chunk must be between %lu and %u\n", PAGE_SIZE, VTFS_IO_CHUNK_MAX);
+    return -EINVAL;
+  }
+  if (opts->conns != VTFS_OPT_UNSET && opts->conns > VTFS_HTTP_POOL_MAX) {
+    LOG("configure: at most %u pooled connections\n", VTFS_HTTP_POOL_MAX);
+    return -EINVAL;
+  }
+
+  struct vtfs_lavnetfs_fs* fs = VTFS_NET(sb);
+  int err = vtfs_http_configure(
+      fs->http, opts->server, opts->token, opts->conns == VTFS_OPT_UNSET ? -1 : (int)opts->conns
+  );
+  if (err) {
+    LOG("configure: bad server or token\n");
+    return err;
+  }
+  if (opts->rpc_chunk != VTFS_OPT_UNSET) {
+    WRITE_ONCE(fs->io_chunk, opts->rpc_chunk);
+  }
+  return 0;
+}
+
+static int vtfs_lavnetfs_statfs(struct super_block* sb, struct kstatfs* buf) {
+  return -EOPNOTSUPP;
+}
+
+// every mount talks to its server through its own endpoint and connection pool
+static int vtfs_lavnetfs_fill_super(struct super_block* sb, const struct vtfs_mount_opts* opts) {
+  struct vtfs_lavnetfs_fs* fs = kzalloc(sizeof(*fs), GFP_KERNEL);
+  if (!fs) {
+    return -ENOMEM;
+  }
+  fs->io_chunk = VTFS_IO_CHUNK;
+  fs->http = vtfs_http_client_alloc(VTFS_SB(sb)->stats);
+  if (!fs->http) {
+    kfree(fs);
+    return -ENOMEM;
+  }
+  VTFS_SB(sb)->storage = fs;
+
+  int err = vtfs_http_configure(fs->http, VTFS_DEFAULT_SERVER, VTFS_DEFAULT_TOKEN, 0);
+  if (!err) {
+    err = vtfs_lavnetfs_configure(sb, opts);
+  }
+  if (err) {
+    VTFS_SB(sb)->storage = NULL;
+    vtfs_http_client_free(fs->http);
+    kfree(fs);
+  }
+  return err;
+}
+
+static void vtfs_lavnetfs_kill_sb(struct super_block* sb) {
+  struct vtfs_lavnetfs_fs* fs = VTFS_NET(sb);
+  if (!fs) {
+    return;  // fill_super failed and cleaned up after itself
+  }
+
+  VTFS_SB(sb)->storage = NULL;
+  vtfs_http_client_free(fs->http);
+  kfree(fs);
+}
+
+// the server owns the ino space
+static void vtfs_lavnetfs_evict(struct super_block* sb, vtfs_ino_t ino) {}
+
+const struct vtfs_backend_ops vtfs_lavnetfs_backend_ops = {
+    .name = "lavnetfs",
+    .flags = VTFS_STORAGE_REMOTE,
+    .init = vtfs_lavnetfs_init,
+    .shutdown = vtfs_lavnetfs_shutdown,
+    .fill_super = vtfs_lavnetfs_fill_super,
+    .kill_sb = vtfs_lavnetfs_kill_sb,
+    .evict = vtfs_lavnetfs_evict,
+    .configure = vtfs_lavnetfs_configure,
+    .statfs = vtfs_lavnetfs_statfs,
+    .get_root = vtfs_lavnetfs_get_root,
+    .lookup = vtfs_lavnetfs_lookup,
+    .iterate_dir = vtfs_lavnetfs_iterate_dir,
+    .iterate_dir_plus = vtfs_lavnetfs_iterate_dir_plus,
+    .create_file = vtfs_lavnetfs_create_file,
+    .unlink = vtfs_lavnetfs_unlink,
+    .mkdir = vtfs_lavnetfs_mkdir,
+    .rmdir = vtfs_lavnetfs_rmdir,
+    .read_file = vtfs_lavnetfs_read_file,
+    .write_file = vtfs_lavnetfs_write_file,
+    .read_iter = vtfs_lavnetfs_read_iter,
+    .write_iter = vtfs_lavnetfs_write_iter,
+    .splice_read = vtfs_lavnetfs_splice_read,
+    .link = vtfs_lavnetfs_link,
+    .truncate = vtfs_lavnetfs_truncate,
+    .copy_range = vtfs_lavnetfs_copy_range,
+    .chmod = vtfs_lavnetfs_chmod,
+    .checkpoint = vtfs_lavnetfs_checkpoint,
+    .sync = vtfs_lavnetfs_sync,
+    .seek_data = vtfs_lavnetfs_seek_data,
+};
@@ -1,477 +1,3227 @@
 #include "vtfs_backend.h"
 
+#include <linux/bitmap.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
 #include <linux/errno.h>
+#include <linux/file.h>
+#include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/lz4.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/percpu_counter.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/rhashtable.h>
+#include <linux/rwsem.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/statfs.h>
 #include <linux/string.h>
+#include <linux/uio.h>
+#include <linux/unaligned.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include <linux/xxhash.h>
 
 #include "vtfs.h"
+#include "vtfs_image.h"
 
 #define VTFS_ROOT_INO 1
 
+// names shorter than this are stored inside the node; 44 rounds the node up to 96 bytes on 64-bit
+#define VTFS_NAME_INLINE_LEN 44
+
+// pointer tag of a vtfs_ram_block entry in a file's pages; untagged entries are struct page
+#define VTFS_ENTRY_BLOCK 1
+
+// tag of a page that is still in an image; above the tag are the slot number and which of the
+// two image files it is in
+#define VTFS_ENTRY_IMAGE 3
+
+// a block is only kept compressed if that saves at least a quarter of it
+#define VTFS_LZ4_MAX_LEN (PAGE_SIZE * 3 / 4)
+
+// bits of the filter of content hashes the scan has seen once; a false positive only freezes a
+// unique page, as if it had a duplicate
+#define VTFS_DEDUP_SEEN_BITS (1 << 20)
+
+// pages the scan handles before it lets waiting readers, writers and checkpoints in
+#define VTFS_SCAN_BATCH 256
+
+// size of each of the two log buffers; a batch is written out without waiting for wal_commit_ms
+// once it is half full, and a writer that finds it full writes it out itself
+#define VTFS_WAL_BATCH_MAX (4 << 20)
+
+// the data of a write is logged in records of at most this much
+#define VTFS_WAL_DATA_MAX (1 << 20)
+
+static bool vtfs_compress;
+module_param_named(compress, vtfs_compress, bool, 0644);
+MODULE_PARM_DESC(compress, "LZ4-compress file pages left untouched for scan_interval seconds");
+
+static bool vtfs_dedup;
+module_param_named(dedup, vtfs_dedup, bool, 0644);
+MODULE_PARM_DESC(dedup, "Share identical file pages left untouched for scan_interval seconds");
+
+static unsigned int vtfs_scan_interval = 30;
+module_param_named(scan_interval, vtfs_scan_interval, uint, 0644);
+MODULE_PARM_DESC(scan_interval, "Seconds between scans for cold pages (default 30)");
+
+static unsigned int vtfs_wal_commit_ms = 100;
+module_param_named(wal_commit_ms, vtfs_wal_commit_ms, uint, 0644);
+MODULE_PARM_DESC(wal_commit_ms, "Milliseconds until a logged change is synced (default 100)");
+
+static unsigned int vtfs_wal_max_mb = 256;
+module_param_named(wal_max_mb, vtfs_wal_max_mb, uint, 0644);
+MODULE_PARM_DESC(wal_max_mb, "Log size in MiB that gets it compacted into the image (default 256)");
+
+/*
+ * Every mount is a separate tree in its own vtfs_ram_fs, nothing below is shared between
+ * mounts except the slab caches.
+ *
+ * Locking:
+ *  - lookup and iterate only take rcu_read_lock(); nodes and payloads are freed after a grace
+ *    period, and the fields they read are updated with WRITE_ONCE().
+ *  - dir_mutex of a directory serializes namespace changes inside it (its children, their
+ *    dentry index entries and its nlink). rmdir also takes the victim's dir_mutex, nested.
+ *  - rwsem of an inode protects its data pages, size, mode and nlink. It nests inside
+ *    dir_mutex.
+ *  - a file page is either private and written in place, or a reference to an immutable
+ *    vtfs_ram_block that other files of the mount may share and that is copied before a write.
+ *    lock of a block only guards switching between its page and its compressed copy.
+ *  - ref counts users of a payload. The inode table holds one reference until the last link
+ *    is gone and the VFS evicted the inode, so that its ino isn't reused while a file that is
+ *    still open reaches it. An inode leaves the table under the quiesce, the final put happens
+ *    after that is dropped.
+ *  - quiesce is held shared by every call that changes the tree or file data and by the scan
+ *    worker for one batch of pages at a time; a checkpoint holds it exclusively. It is the
+ *    outermost lock.
+ *  - a change is appended to the write-ahead log while the locks that order it against
+ *    conflicting changes are still held, so the log replays in a valid order.
+ */
 struct vtfs_inode_payload {
-  struct vtfs_node_meta meta;
-
-  char* data;
-  size_t capacity;
-  struct vtfs_inode_payload* next;
+  struct vtfs_ram_fs* fs;  // the mount the inode belongs to
+  vtfs_ino_t ino;
+  loff_t size;
+  nlink_t nlink;
+  enum vtfs_node_type type;
+  umode_t mode;
+  refcount_t ref;
+  struct rw_semaphore rwsem;
+  struct rcu_head rcu;
+
+  union {
+    // files: page index -> struct page or VTFS_ENTRY_BLOCK-tagged vtfs_ram_block, absent
+    // pages are holes that read as zeroes
+    struct xarray pages;
+
+    // directories: cookie -> vtfs_ram_node, cookies are handed out cyclically
+    struct {
+      struct mutex dir_mutex;
+      struct xarray children;
+      u32 next_cookie;
+    };
+  };
 };
 
 struct vtfs_ram_node {
   vtfs_ino_t parent_ino;
-  char name[NAME_MAX + 1];
   struct vtfs_inode_payload* inode;
-  struct vtfs_ram_node* next;
+  struct rhash_head hash;
+  struct rcu_head rcu;
+  const char* name;  // points at inline_name or at a separate allocation for long names
+  u32 cookie;        // position in the parent's children, stable for the node's lifetime
+  char inline_name[VTFS_NAME_INLINE_LEN];
 };
 
-static struct vtfs_ram_node* vtfs_nodes_head = NULL;
-static struct vtfs_inode_payload* vtfs_inodes_head = NULL;
-static vtfs_ino_t vtfs_next_ino = VTFS_ROOT_INO + 1;
+// LZ4 copy of a cold block, freed after a grace period so readers can decompress under RCU
+struct vtfs_zchunk {
+  struct rcu_head rcu;
+  u32 len;
+  char data[];
+};
 
-static struct vtfs_inode_payload* vtfs_find_inode(vtfs_ino_t ino) {
-  struct vtfs_inode_payload* cur = vtfs_inodes_head;
+// immutable page of file data, shared by every file page with the same content once dedup
+// finds them; exactly one of page and z is set
+struct vtfs_ram_block {
+  refcount_t ref;
+  spinlock_t lock;
+  struct page* page;
+  struct vtfs_zchunk* z;
+  u64 hash;  // xxh64 of the content
+  struct rhash_head node;
+  struct rcu_head rcu;
+  u32 scan_gen;  // last scan that looked at the block, so shared blocks are visited once
+  bool indexed;  // false if the block is not in the blocks index, e.g. after a hash collision
+  u32 ckpt_gen;  // last checkpoint that wrote the block, to ckpt_slot
+  u64 ckpt_slot;
+};
 
-  while (cur) {
-    if (cur->meta.ino == ino) {
-      return cur;
-    }
-    cur = cur->next;
-  }
+struct vtfs_ram_stats {
+  atomic64_t blocks;
+  atomic64_t dedup_saved;  // file pages sharing a block instead of holding their own copy
+  atomic64_t dedup_hits;
+  atomic64_t cow_copies;
+  atomic64_t chunks;  // blocks currently held compressed
+  atomic64_t bytes;   // their compressed size
+  atomic64_t compressed;
+  atomic64_t incompressible;
+  atomic64_t decompressed;
+  atomic64_t decompress_ns;
+  atomic64_t image_faults;
+  atomic64_t wal_records;
+  atomic64_t wal_commits;  // write + fsync of a batch of records
+  atomic64_t wal_bytes;
+};
+
+// one mount of the RAM backend, in vtfs_sb_info->storage
+struct vtfs_ram_fs {
+  // ino -> vtfs_inode_payload; inos are handed out cyclically from next_ino, a freed one is
+  // only reused after the counter wraps
+  struct xarray inodes;
+  u32 next_ino;
+  // (parent_ino, name) -> vtfs_ram_node; the root node is not indexed
+  struct rhashtable dentries;
+  // content index of blocks, lookups verify the content since xxh64 may collide
+  struct rhashtable blocks;
+
+  // capacity limits, 0 means unlimited; like tmpfs the default is half of RAM
+  u64 max_blocks;
+  u64 max_inodes;
+  struct percpu_counter used_blocks;
+  struct percpu_counter used_inodes;
+
+  struct percpu_rw_semaphore quiesce;
+  u32 ckpt_gen;
+
+  struct vtfs_ram_stats stats;
+  struct dentry* stats_dentry;
+
+  // used only by the scan worker, which never runs concurrently with itself
+  struct delayed_work scan_work;
+  void* lz4_wrkmem;
+  char* lz4_buf;
+  void* scratch;
+  unsigned long* dedup_seen;  // allocated on the first scan with dedup on, cleared on every scan
+  u32 scan_gen;
+
+  // checkpoints alternate between image_path and image_alt, <image_path>.1
+  char* image_path;
+  char* image_alt;
+  // the image files, each open while file pages may still point into it
+  struct file* image_file[2];
+  u64 image_gen;  // generation of the newest image
+  int image_cur;  // which of the two image files holds it, see vtfs_image_name()
+
+  // write-ahead log; records collect in wal_buf and one write and fsync of the log makes a
+  // whole batch of them durable
+  char* wal_path;
+  struct file* wal_file;
+  struct delayed_work wal_work;
+  struct mutex wal_lock;  // buf, len, seq and err
+  char* wal_buf;          // VTFS_WAL_BATCH_MAX bytes, like wal_spare
+  size_t wal_len;
+  u64 wal_seq;  // last record appended
+  int wal_err;  // first failure since the last compaction, nothing is logged after it
+  struct mutex wal_flush_lock;  // the log file and the fields below
+  char* wal_spare;              // the batch being written out
+  u64 wal_synced_seq;
+  loff_t wal_size;
+  loff_t wal_compact_at;  // past a failed compaction, the size to retry at
+
+  struct list_head mounts;  // in vtfs_ram_mounts while the mount is live
+};
 
-  return NULL;
+static inline struct vtfs_ram_fs* VTFS_RAM(struct super_block* sb) {
+  return VTFS_SB(sb)->storage;
 }
 
-static struct vtfs_ram_node* vtfs_find_dentry(vtfs_ino_t parent, const char* name) {
-  struct vtfs_ram_node* cur = vtfs_nodes_head;
+static struct kmem_cache* vtfs_payload_cache;
+static struct kmem_cache* vtfs_node_cache;
 
-  while (cur) {
-    if (cur->parent_ino == parent && !strcmp(cur->name, name)) {
-      return cur;
-    }
-    cur = cur->next;
-  }
+// the mounts with an image= or wal=, no two of them may write the same file
+static LIST_HEAD(vtfs_ram_mounts);
+static DEFINE_MUTEX(vtfs_ram_mounts_lock);
+
+// dentry index key: a name is unique within its parent directory
+struct vtfs_dentry_key {
+  vtfs_ino_t parent_ino;
+  const char* name;
+};
 
-  return NULL;
+static u32 vtfs_dentry_hash(vtfs_ino_t parent_ino, const char* name, u32 seed) {
+  return jhash(name, strlen(name), jhash(&parent_ino, sizeof(parent_ino), seed));
 }
 
-static struct vtfs_inode_payload* vtfs_alloc_payload(enum vtfs_node_type type, umode_t mode) {
-  struct vtfs_inode_payload* payload = kzalloc(sizeof(*payload), GFP_KERNEL);
-  if (!payload) {
-    return NULL;
-  }
-  payload->meta.type = type;
-  payload->meta.mode = mode;
-  payload->meta.size = 0;
-  payload->meta.nlink = (type == VTFS_NODE_DIR) ? 2 : 1;
-  payload->data = NULL;
-  payload->capacity = 0;
-  payload->next = vtfs_inodes_head;
-  vtfs_inodes_head = payload;
-  return payload;
+static u32 vtfs_dentry_key_hashfn(const void* data, u32 len, u32 seed) {
+  const struct vtfs_dentry_key* key = data;
+  return vtfs_dentry_hash(key->parent_ino, key->name, seed);
 }
 
-static void vtfs_free_payload(struct vtfs_inode_payload* payload) {
-  struct vtfs_inode_payload** cur = &vtfs_inodes_head;
-  while (*cur) {
-    if (*cur == payload) {
-      *cur = payload->next;
-      kfree(payload->data);
-      kfree(payload);
-      return;
-    }
-    cur = &(*cur)->next;
+static u32 vtfs_dentry_obj_hashfn(const void* data, u32 len, u32 seed) {
+  const struct vtfs_ram_node* node = data;
+  return vtfs_dentry_hash(node->parent_ino, node->name, seed);
+}
+
+static int vtfs_dentry_obj_cmpfn(struct rhashtable_compare_arg* arg, const void* obj) {
+  const struct vtfs_dentry_key* key = arg->key;
+  const struct vtfs_ram_node* node = obj;
+  return node->parent_ino != key->parent_ino || strcmp(node->name, key->name);
+}
+
+static const struct rhashtable_params vtfs_dentry_params = {
+    .head_offset = offsetof(struct vtfs_ram_node, hash),
+    .hashfn = vtfs_dentry_key_hashfn,
+    .obj_hashfn = vtfs_dentry_obj_hashfn,
+    .obj_cmpfn = vtfs_dentry_obj_cmpfn,
+    .automatic_shrinking = true,
+};
+
+static const struct rhashtable_params vtfs_block_params = {
+    .key_len = sizeof(u64),
+    .key_offset = offsetof(struct vtfs_ram_block, hash),
+    .head_offset = offsetof(struct vtfs_ram_block, node),
+    .automatic_shrinking = true,
+};
+
+// reserves amount units against limit, all or nothing
+static bool vtfs_charge(struct percpu_counter* used, u64 limit, s64 amount) {
+  if (!limit) {
+    percpu_counter_add(used, amount);
+    return true;
   }
+  return percpu_counter_limited_add(used, limit, amount);
 }
 
-static struct vtfs_ram_node* vtfs_alloc_node(void) {
-  struct vtfs_ram_node* node = kzalloc(sizeof(*node), GFP_KERNEL);
-  if (!node) {
-    return NULL;
+// takes a reference on a live inode; NULL if there is none with this ino
+static struct vtfs_inode_payload* vtfs_grab_payload(struct vtfs_ram_fs* fs, vtfs_ino_t ino) {
+  rcu_read_lock();
+  struct vtfs_inode_payload* payload = xa_load(&fs->inodes, ino);
+  if (payload && !refcount_inc_not_zero(&payload->ref)) {
+    payload = NULL;
   }
+  rcu_read_unlock();
+  return payload;
+}
 
-  node->next = vtfs_nodes_head;
-  vtfs_nodes_head = node;
-  return node;
+static void vtfs_free_zchunk(struct vtfs_ram_fs* fs, struct vtfs_zchunk* z) {
+  atomic64_dec(&fs->stats.chunks);
+  atomic64_sub(z->len, &fs->stats.bytes);
+  kfree_rcu(z, rcu);
+}
+
+static bool vtfs_is_block(void* entry) {
+  return xa_pointer_tag(entry) == VTFS_ENTRY_BLOCK;
+}
+
+static bool vtfs_is_image(void* entry) {
+  return xa_pointer_tag(entry) == VTFS_ENTRY_IMAGE;
+}
+
+static void* vtfs_mk_image_entry(u64 slot, int which) {
+  return xa_tag_pointer((void*)(unsigned long)((slot << 1 | which) << 2), VTFS_ENTRY_IMAGE);
 }
 
-static void vtfs_free_all_nodes(void) {
-  struct vtfs_ram_node* cur = vtfs_nodes_head;
-  while (cur) {
-    struct vtfs_ram_node* next = cur->next;
-    kfree(cur);
-    cur = next;
+static u64 vtfs_image_slot(void* entry) {
+  return (unsigned long)xa_untag_pointer(entry) >> 3;
+}
+
+static int vtfs_image_which(void* entry) {
+  return ((unsigned long)xa_untag_pointer(entry) >> 2) & 1;
+}
+
+static void vtfs_put_block(struct vtfs_ram_fs* fs, struct vtfs_ram_block* block) {
+  if (!refcount_dec_and_test(&block->ref)) {
+    atomic64_dec(&fs->stats.dedup_saved);
+    return;
   }
-  vtfs_nodes_head = NULL;
-  struct vtfs_inode_payload* ip = vtfs_inodes_head;
-  while (ip) {
-    struct vtfs_inode_payload* next = ip->next;
-    kfree(ip->data);
-    kfree(ip);
-    ip = next;
+
+  if (block->indexed) {
+    rhashtable_remove_fast(&fs->blocks, &block->node, vtfs_block_params);
+  }
+  if (block->page) {
+    put_page(block->page);
+  } else {
+    vtfs_free_zchunk(fs, block->z);
   }
-  vtfs_inodes_head = NULL;
-  vtfs_next_ino = VTFS_ROOT_INO + 1;
+  atomic64_dec(&fs->stats.blocks);
+  kfree_rcu(block, rcu);
 }
 
-int vtfs_storage_init(void) {
-  LOG("storage_init\n");
+// releases a file page entry that another entry replaced, its slot stays charged
+static void vtfs_drop_entry(struct vtfs_ram_fs* fs, void* entry) {
+  if (vtfs_is_block(entry)) {
+    vtfs_put_block(fs, xa_untag_pointer(entry));
+  } else if (!vtfs_is_image(entry)) {
+    __free_page(entry);
+  }
+}
 
-  vtfs_free_all_nodes();
+// releases a file page entry that was removed from the file's pages
+static void vtfs_free_entry(struct vtfs_ram_fs* fs, void* entry) {
+  vtfs_drop_entry(fs, entry);
+  percpu_counter_dec(&fs->used_blocks);
+}
 
-  struct vtfs_inode_payload* root_inode = vtfs_alloc_payload(VTFS_NODE_DIR, S_IFDIR | 0777);
-  if (!root_inode) {
-    return -ENOMEM;
+// drops every data page at or after index
+static void vtfs_free_pages(struct vtfs_inode_payload* payload, pgoff_t first) {
+  void* entry;
+  unsigned long index;
+  xa_for_each_start(&payload->pages, index, entry, first) {
+    xa_erase(&payload->pages, index);
+    vtfs_free_entry(payload->fs, entry);
   }
+}
 
-  root_inode->meta.ino = VTFS_ROOT_INO;
-  root_inode->meta.nlink = 2;
+static void vtfs_destroy_payload(struct vtfs_inode_payload* payload) {
+  if (payload->type == VTFS_NODE_DIR) {
+    mutex_destroy(&payload->dir_mutex);
+    xa_destroy(&payload->children);
+  } else {
+    vtfs_free_pages(payload, 0);
+    xa_destroy(&payload->pages);
+  }
+  percpu_counter_dec(&payload->fs->used_inodes);
+}
 
-  struct vtfs_ram_node* root = vtfs_alloc_node();
-  if (!root) {
-    LOG("failed to allocate root\n");
-    return -ENOMEM;
+static void vtfs_free_payload_rcu(struct rcu_head* head) {
+  kmem_cache_free(vtfs_payload_cache, container_of(head, struct vtfs_inode_payload, rcu));
+}
+
+static void vtfs_put_payload(struct vtfs_inode_payload* payload) {
+  if (refcount_dec_and_test(&payload->ref)) {
+    // nobody can reach the data anymore, lockless readers may still look at the fields
+    vtfs_destroy_payload(payload);
+    call_rcu(&payload->rcu, vtfs_free_payload_rcu);
   }
+}
 
-  root->parent_ino = VTFS_ROOT_INO;
-  root->name[0] = '\0';
-  root->inode = root_inode;
+// takes an inode out of the inode table; called with the quiesce held, so a checkpoint never
+// walks an inode that is being freed. The caller drops the table's reference afterwards,
+// outside of its locks.
+static void vtfs_unhash_payload(struct vtfs_inode_payload* payload) {
+  xa_erase(&payload->fs->inodes, payload->ino);
+}
 
-  LOG("root created: ino=%lu\n", (unsigned long)root_inode->meta.ino);
-  return 0;
+// releases the ino of an inode without links once nothing can use it anymore
+static void vtfs_forget_payload(struct vtfs_ram_fs* fs, vtfs_ino_t ino) {
+  percpu_down_read(&fs->quiesce);
+  rcu_read_lock();
+  struct vtfs_inode_payload* payload = xa_load(&fs->inodes, ino);
+  if (payload && READ_ONCE(payload->nlink)) {
+    payload = NULL;
+  }
+  rcu_read_unlock();
+  // nlink never goes back up from 0; the cmpxchg settles a race with another forget
+  if (payload && xa_cmpxchg(&fs->inodes, ino, payload, NULL, 0) != payload) {
+    payload = NULL;
+  }
+  percpu_up_read(&fs->quiesce);
+  if (payload) {
+    vtfs_put_payload(payload);
+  }
 }
 
-void vtfs_storage_shutdown(void) {
-  vtfs_free_all_nodes();
-  LOG("vtfs_storage_shutdown: all nodes freed\n");
+static struct vtfs_ram_node* vtfs_find_dentry(
+    struct vtfs_ram_fs* fs, vtfs_ino_t parent, const char* name
+) {
+  struct vtfs_dentry_key key = {.parent_ino = parent, .name = name};
+  return rhashtable_lookup_fast(&fs->dentries, &key, vtfs_dentry_params);
 }
 
-static void vtfs_fill_meta(struct vtfs_node_meta* out, struct vtfs_ram_node* dentry) {
-  out->ino = dentry->inode->meta.ino;
-  out->parent_ino = dentry->parent_ino;
-  out->type = dentry->inode->meta.type;
-  out->mode = dentry->inode->meta.mode;
-  out->size = dentry->inode->meta.size;
-  out->nlink = dentry->inode->meta.nlink;
+static int vtfs_index_dentry(struct vtfs_ram_fs* fs, struct vtfs_ram_node* node) {
+  struct vtfs_dentry_key key = {.parent_ino = node->parent_ino, .name = node->name};
+  return rhashtable_lookup_insert_key(&fs->dentries, &key, &node->hash, vtfs_dentry_params);
 }
 
-int vtfs_storage_get_root(struct vtfs_node_meta* out) {
-  struct vtfs_ram_node* root = vtfs_nodes_head;
-  if (!root || root->inode->meta.ino != VTFS_ROOT_INO) {
-    return -ENOENT;
+static void vtfs_unindex_dentry(struct vtfs_ram_fs* fs, struct vtfs_ram_node* node) {
+  rhashtable_remove_fast(&fs->dentries, &node->hash, vtfs_dentry_params);
+}
+
+// publishes a filled-in node in the dentry index and in its parent's children
+static int vtfs_attach_node(struct vtfs_inode_payload* parent, struct vtfs_ram_node* node) {
+  lockdep_assert_held(&parent->dir_mutex);
+
+  int err = vtfs_index_dentry(parent->fs, node);
+  if (err) {
+    return err;
+  }
+
+  err = xa_alloc_cyclic(
+      &parent->children,
+      &node->cookie,
+      node,
+      xa_limit_32b,
+      &parent->next_cookie,
+      GFP_KERNEL_ACCOUNT
+  );
+  if (err < 0) {
+    vtfs_unindex_dentry(parent->fs, node);
+    return err;
   }
-  vtfs_fill_meta(out, root);
   return 0;
 }
 
-int vtfs_storage_lookup(vtfs_ino_t parent, const char* name, struct vtfs_node_meta* out) {
-  LOG("lookup: parent=%lu name=%s\n", parent, name);
+static void vtfs_detach_node(struct vtfs_inode_payload* parent, struct vtfs_ram_node* node) {
+  lockdep_assert_held(&parent->dir_mutex);
+
+  vtfs_unindex_dentry(parent->fs, node);
+  xa_erase(&parent->children, node->cookie);
+}
+
+// allocates a payload together with its ino; the first one allocated gets VTFS_ROOT_INO
+// ino 0 picks the next free number; restore passes the number recorded in the image
+static struct vtfs_inode_payload* vtfs_alloc_payload(
+    struct vtfs_ram_fs* fs, enum vtfs_node_type type, umode_t mode, vtfs_ino_t ino
+) {
+  if (!vtfs_charge(&fs->used_inodes, fs->max_inodes, 1)) {
+    return ERR_PTR(-ENOSPC);
+  }
+
+  struct vtfs_inode_payload* payload = kmem_cache_zalloc(vtfs_payload_cache, GFP_KERNEL);
+  if (!payload) {
+    percpu_counter_dec(&fs->used_inodes);
+    return ERR_PTR(-ENOMEM);
+  }
+  payload->fs = fs;
+  payload->type = type;
+  payload->mode = mode;
+  payload->size = 0;
+  payload->nlink = (type == VTFS_NODE_DIR) ? 2 : 1;
+  refcount_set(&payload->ref, 1);
+  init_rwsem(&payload->rwsem);
+  if (type == VTFS_NODE_DIR) {
+    mutex_init(&payload->dir_mutex);
+    xa_init_flags(&payload->children, XA_FLAGS_ALLOC);
+  } else {
+    xa_init(&payload->pages);
+  }
+
+  int err;
+  if (ino) {
+    err = xa_insert(&fs->inodes, ino, payload, GFP_KERNEL_ACCOUNT);
+  } else {
+    u32 id;
+    err = xa_alloc_cyclic(
+        &fs->inodes,
+        &id,
+        payload,
+        XA_LIMIT(VTFS_ROOT_INO, U32_MAX),
+        &fs->next_ino,
+        GFP_KERNEL_ACCOUNT
+    );
+    err = err == -EBUSY ? -ENOSPC : min(err, 0);
+    ino = id;
+  }
+  if (err) {
+    vtfs_destroy_payload(payload);
+    kmem_cache_free(vtfs_payload_cache, payload);
+    return ERR_PTR(err);
+  }
+  payload->ino = ino;
+  return payload;
+}
 
-  struct vtfs_ram_node* node = vtfs_find_dentry(parent, name);
+static struct vtfs_ram_node* vtfs_alloc_node(
+    vtfs_ino_t parent, const char* name, struct vtfs_inode_payload* inode
+) {
+  struct vtfs_ram_node* node = kmem_cache_zalloc(vtfs_node_cache, GFP_KERNEL_ACCOUNT);
   if (!node) {
-    LOG("lookup: not found\n");
-    return -ENOENT;
+    return NULL;
   }
 
-  vtfs_fill_meta(out, node);
-  LOG("lookup: found ino=%lu\n", (unsigned long)out->ino);
-  return 0;
+  size_t len = strnlen(name, NAME_MAX);
+  if (len < VTFS_NAME_INLINE_LEN) {
+    memcpy(node->inline_name, name, len);
+    node->name = node->inline_name;
+  } else {
+    node->name = kstrndup(name, len, GFP_KERNEL_ACCOUNT);
+    if (!node->name) {
+      kmem_cache_free(vtfs_node_cache, node);
+      return NULL;
+    }
+  }
+
+  node->parent_ino = parent;
+  node->inode = inode;
+  return node;
 }
 
-int vtfs_storage_iterate_dir(vtfs_ino_t dir_ino, unsigned long* offset, struct vtfs_dirent* out) {
-  unsigned long count = 0;
-  struct vtfs_ram_node* cur = vtfs_nodes_head;
+static void vtfs_free_node(struct vtfs_ram_node* node) {
+  if (node->name != node->inline_name) {
+    kfree(node->name);
+  }
+  kmem_cache_free(vtfs_node_cache, node);
+}
 
-  LOG("iterate: dir=%lu offset=%lu\n", dir_ino, *offset);
+static void vtfs_free_node_rcu(struct rcu_head* head) {
+  vtfs_free_node(container_of(head, struct vtfs_ram_node, rcu));
+}
 
-  while (cur) {
-    if (cur->parent_ino == dir_ino && cur->name[0] != '\0') {
-      if (count == *offset) {
-        strncpy(out->name, cur->name, NAME_MAX);
-        out->name[NAME_MAX] = '\0';
-        out->ino = cur->inode->meta.ino;
-        out->type = cur->inode->meta.type;
-        (*offset)++;
-        LOG("iterate: emit %s (ino=%lu)\n", out->name, (unsigned long)out->ino);
-        return 0;
+// every node lives in exactly one directory's children, so freeing those frees them all;
+// only called when nothing else can touch the tree
+static void vtfs_free_all_nodes(struct vtfs_ram_fs* fs) {
+  struct vtfs_inode_payload* ip;
+  unsigned long ino;
+  xa_for_each(&fs->inodes, ino, ip) {
+    if (ip->type == VTFS_NODE_DIR) {
+      struct vtfs_ram_node* node;
+      unsigned long cookie;
+      xa_for_each(&ip->children, cookie, node) {
+        vtfs_free_node(node);
       }
-      count++;
     }
-    cur = cur->next;
+    vtfs_destroy_payload(ip);
+    kmem_cache_free(vtfs_payload_cache, ip);
   }
-
-  LOG("iterate: end\n");
-  return -ENOENT;
+  xa_destroy(&fs->inodes);
 }
 
-int vtfs_storage_create_file(
-    vtfs_ino_t parent, const char* name, umode_t mode, struct vtfs_node_meta* out
-) {
-  LOG("create: parent=%lu name=%s mode=%o\n", parent, name, mode);
+// marks a page as used since the last scan
+static void vtfs_touch_page(struct page* page) {
+  if (!PageReferenced(page)) {
+    SetPageReferenced(page);
+  }
+}
 
-  if (vtfs_find_dentry(parent, name)) {
-    LOG("create: already exists\n");
-    return -EEXIST;
+// reads a page that is still in the image and puts it in place of the image entry; racing
+// readers may both read it, the loser frees its copy
+static void* vtfs_fault_in(struct vtfs_inode_payload* inode, pgoff_t index, void* entry) {
+  struct vtfs_ram_fs* fs = inode->fs;
+  struct page* page = alloc_page(GFP_KERNEL | __GFP_ACCOUNT);
+  if (!page) {
+    return ERR_PTR(-ENOMEM);
   }
 
-  struct vtfs_inode_payload* parent_payload = vtfs_find_inode(parent);
-  if (!parent_payload || parent_payload->meta.type != VTFS_NODE_DIR) {
-    LOG("create: parent is not dir\n");
-    return -ENOTDIR;
+  loff_t pos = PAGE_SIZE + (vtfs_image_slot(entry) << PAGE_SHIFT);
+  ssize_t n =
+      kernel_read(fs->image_file[vtfs_image_which(entry)], page_address(page), PAGE_SIZE, &pos);
+  if (n != PAGE_SIZE) {
+    __free_page(page);
+    return ERR_PTR(n < 0 ? n : -EIO);
   }
+  atomic64_inc(&fs->stats.image_faults);
 
-  struct vtfs_inode_payload* payload = vtfs_alloc_payload(VTFS_NODE_FILE, S_IFREG | (mode & 0777));
-  if (!payload) {
-    LOG("create: alloc failed\n");
-    return -ENOMEM;
+  // the entry already exists, so this never allocates
+  void* old = xa_cmpxchg(&inode->pages, index, entry, page, GFP_NOWAIT);
+  if (old != entry) {
+    __free_page(page);
+    return xa_is_err(old) ? ERR_PTR(xa_err(old)) : old;
   }
+  SetPageReferenced(page);
+  return page;
+}
 
-  payload->meta.ino = vtfs_next_ino++;
+// the entry at index, with a page that is still in the image read in first
+static void* vtfs_load_entry(struct vtfs_inode_payload* inode, pgoff_t index) {
+  void* entry = xa_load(&inode->pages, index);
+  return vtfs_is_image(entry) ? vtfs_fault_in(inode, index, entry) : entry;
+}
 
-  struct vtfs_ram_node* node = vtfs_alloc_node();
-  if (!node) {
-    vtfs_free_payload(payload);
-    return -ENOMEM;
+// swaps the compressed copy of a block for a decompressed page; NULL if somebody else did it
+// first
+static struct page* vtfs_thaw_block(struct vtfs_ram_fs* fs, struct vtfs_ram_block* block) {
+  struct page* page = alloc_page(GFP_HIGHUSER | __GFP_ACCOUNT);
+  if (!page) {
+    return ERR_PTR(-ENOMEM);
   }
 
-  node->parent_ino = parent;
+  rcu_read_lock();
+  struct vtfs_zchunk* z = READ_ONCE(block->z);
+  if (!z) {
+    rcu_read_unlock();
+    __free_page(page);
+    return NULL;
+  }
+
+  u64 start = ktime_get_ns();
+  void* dst = kmap_local_page(page);
+  int ret = LZ4_decompress_safe(z->data, dst, z->len, PAGE_SIZE);
+  kunmap_local(dst);
+  rcu_read_unlock();
 
-  strncpy(node->name, name, NAME_MAX);
-  node->name[NAME_MAX] = '\0';
-  node->inode = payload;
+  if (ret != PAGE_SIZE) {
+    __free_page(page);
+    return ERR_PTR(-EIO);
+  }
+  atomic64_inc(&fs->stats.decompressed);
+  atomic64_add(ktime_get_ns() - start, &fs->stats.decompress_ns);
 
-  vtfs_fill_meta(out, node);
+  spin_lock(&block->lock);
+  if (block->z != z) {
+    spin_unlock(&block->lock);
+    __free_page(page);
+    return NULL;
+  }
+  SetPageReferenced(page);
+  block->page = page;
+  block->z = NULL;
+  spin_unlock(&block->lock);
 
-  LOG("create: created ino=%lu\n", (unsigned long)out->ino);
-  return 0;
+  vtfs_free_zchunk(fs, z);
+  return page;
 }
 
-int vtfs_storage_unlink(vtfs_ino_t parent, const char* name) {
-  LOG("unlink: parent=%lu name=%s\n", parent, name);
-  struct vtfs_ram_node** cur = &vtfs_nodes_head;
+// returns the block's page with an extra reference, decompressing it first if needed
+static struct page* vtfs_block_get_page(struct vtfs_ram_fs* fs, struct vtfs_ram_block* block) {
+  for (;;) {
+    spin_lock(&block->lock);
+    struct page* page = block->page;
+    if (page) {
+      get_page(page);
+    }
+    spin_unlock(&block->lock);
 
-  while (*cur) {
-    if ((*cur)->parent_ino == parent && !strcmp((*cur)->name, name)) {
-      if ((*cur)->inode->meta.type != VTFS_NODE_FILE) {
-        LOG("unlink: not a file\n");
-        return -EPERM;
-      }
+    if (page) {
+      vtfs_touch_page(page);
+      return page;
+    }
 
-      struct vtfs_ram_node* victim = *cur;
-      *cur = victim->next;
+    page = vtfs_thaw_block(fs, block);
+    if (IS_ERR(page)) {
+      return page;
+    }
+  }
+}
 
-      victim->inode->meta.nlink--;
-      if (victim->inode->meta.nlink == 0) {
-        LOG("unlink: freeing payload for ino=%lu\n", victim->inode->meta.ino);
-        vtfs_free_payload(victim->inode);
-      }
+// copies the content of a block into buf without thawing it
+static int vtfs_block_read(struct vtfs_ram_block* block, void* buf) {
+  rcu_read_lock();
+  spin_lock(&block->lock);
+  struct page* page = block->page;
+  struct vtfs_zchunk* z = block->z;
+  if (page) {
+    get_page(page);
+  }
+  spin_unlock(&block->lock);
 
-      kfree(victim);
-      return 0;
-    }
-    cur = &(*cur)->next;
+  if (page) {
+    rcu_read_unlock();
+    memcpy_from_page(buf, page, 0, PAGE_SIZE);
+    put_page(page);
+    return 0;
   }
 
-  LOG("unlink: not found\n");
-  return -ENOENT;
+  int ret = LZ4_decompress_safe(z->data, buf, z->len, PAGE_SIZE);
+  rcu_read_unlock();
+  return ret == PAGE_SIZE ? 0 : -EIO;
 }
 
-// --- dirs ---
-int vtfs_storage_mkdir(
-    vtfs_ino_t parent, const char* name, umode_t mode, struct vtfs_node_meta* out
+static bool vtfs_block_equals(
+    struct vtfs_ram_fs* fs, struct vtfs_ram_block* block, const void* data
 ) {
-  LOG("mkdir: parent=%lu name='%s' mode=%o\n", (unsigned long)parent, name, mode);
+  return !vtfs_block_read(block, fs->scratch) && !memcmp(fs->scratch, data, PAGE_SIZE);
+}
 
-  if (vtfs_find_dentry(parent, name)) {
-    LOG("mkdir failed: '%s' already exists in %lu\n", name, (unsigned long)parent);
-    return -EEXIST;
+// takes a reference on the block holding exactly this data, NULL if there is none
+static struct vtfs_ram_block* vtfs_find_block(struct vtfs_ram_fs* fs, u64 hash, const void* data) {
+  rcu_read_lock();
+  struct vtfs_ram_block* block = rhashtable_lookup(&fs->blocks, &hash, vtfs_block_params);
+  if (block && !refcount_inc_not_zero(&block->ref)) {
+    block = NULL;
   }
+  rcu_read_unlock();
 
-  struct vtfs_inode_payload* parent_payload = vtfs_find_inode(parent);
-  if (!parent_payload || parent_payload->meta.type != VTFS_NODE_DIR) {
-    LOG("mkdir failed: parent %lu is not a directory\n", (unsigned long)parent);
-    return -ENOTDIR;
+  if (!block) {
+    return NULL;
   }
+  atomic64_inc(&fs->stats.dedup_saved);
 
-  struct vtfs_inode_payload* payload = vtfs_alloc_payload(VTFS_NODE_DIR, S_IFDIR | (mode & 0777));
-  if (!payload) {
-    LOG("mkdir failed: out of memory\n");
-    return -ENOMEM;
+  if (!vtfs_block_equals(fs, block, data)) {
+    vtfs_put_block(fs, block);
+    return NULL;
   }
+  return block;
+}
 
-  payload->meta.ino = vtfs_next_ino++;
-  payload->meta.nlink = 2;
-  parent_payload->meta.nlink++;
+// whether another page with this hash went through the current scan; without a filter every page
+// counts as seen
+static bool vtfs_dedup_seen(struct vtfs_ram_fs* fs, u64 hash) {
+  return !fs->dedup_seen || test_and_set_bit(hash & (VTFS_DEDUP_SEEN_BITS - 1), fs->dedup_seen);
+}
 
-  struct vtfs_ram_node* node = vtfs_alloc_node();
-  if (!node) {
-    vtfs_free_payload(payload);
-    parent_payload->meta.nlink--;
-    return -ENOMEM;
+// turns a private page into a block entry, sharing an existing block with the same content if
+// dedup is on. Unless always is set, a page no other page matched so far stays private and NULL
+// is returned, a block would only cost memory; the next page with that content is frozen and
+// this one shares it on the following scan. Caller holds the write side of rwsem.
+static struct vtfs_ram_block* vtfs_freeze_page(
+    struct vtfs_inode_payload* inode, pgoff_t index, struct page* page, bool dedup, bool always
+) {
+  struct vtfs_ram_fs* fs = inode->fs;
+  struct vtfs_ram_block* block = NULL;
+  u64 hash = 0;
+
+  if (dedup) {
+    void* data = kmap_local_page(page);
+    hash = xxh64(data, PAGE_SIZE, 0);
+    block = vtfs_find_block(fs, hash, data);
+    kunmap_local(data);
+    if (!block && !always && !vtfs_dedup_seen(fs, hash)) {
+      return NULL;
+    }
   }
 
-  node->parent_ino = parent;
+  if (block) {
+    atomic64_inc(&fs->stats.dedup_hits);
+    __free_page(page);
+  } else {
+    block = kzalloc(sizeof(*block), GFP_KERNEL_ACCOUNT | __GFP_NOWARN);
+    if (!block) {
+      return NULL;
+    }
+    refcount_set(&block->ref, 1);
+    spin_lock_init(&block->lock);
+    block->page = page;
+    block->hash = hash;
+    // on a collision with different content the block just stays out of the index
+    block->indexed =
+        dedup && !rhashtable_lookup_insert_fast(&fs->blocks, &block->node, vtfs_block_params);
+    atomic64_inc(&fs->stats.blocks);
+  }
 
-  strncpy(node->name, name, NAME_MAX);
-  node->name[NAME_MAX] = '\0';
+  // the entry already exists, so this never allocates
+  xa_store(&inode->pages, index, xa_tag_pointer(block, VTFS_ENTRY_BLOCK), GFP_NOWAIT);
+  return block;
+}
 
-  node->inode = payload;
+// replaces the page of a cold block with its LZ4 copy
+static void vtfs_compress_block(struct vtfs_ram_fs* fs, struct vtfs_ram_block* block) {
+  if (block->scan_gen == fs->scan_gen) {
+    return;
+  }
+  block->scan_gen = fs->scan_gen;
 
-  vtfs_fill_meta(out, node);
+  // only this worker clears block->page, so it stays put until the swap below
+  struct page* page = READ_ONCE(block->page);
+  if (!page || TestClearPageReferenced(page)) {
+    return;
+  }
 
-  LOG("mkdir success: '%s' (ino=%lu) under parent=%lu\n",
-      name,
-      (unsigned long)node->inode->meta.ino,
-      (unsigned long)parent);
+  void* src = kmap_local_page(page);
+  int len = LZ4_compress_default(src, fs->lz4_buf, PAGE_SIZE, VTFS_LZ4_MAX_LEN, fs->lz4_wrkmem);
+  kunmap_local(src);
+  if (len <= 0) {
+    atomic64_inc(&fs->stats.incompressible);
+    SetPageReferenced(page);  // don't retry it on the next scan
+    return;
+  }
 
-  return 0;
+  struct vtfs_zchunk* z = kmalloc(struct_size(z, data, len), GFP_KERNEL_ACCOUNT | __GFP_NOWARN);
+  if (!z) {
+    return;
+  }
+  z->len = len;
+  memcpy(z->data, fs->lz4_buf, len);
+
+  spin_lock(&block->lock);
+  block->page = NULL;
+  block->z = z;
+  spin_unlock(&block->lock);
+  // readers that still copy from the page hold their own reference
+  put_page(page);
+
+  atomic64_inc(&fs->stats.chunks);
+  atomic64_add(len, &fs->stats.bytes);
+  atomic64_inc(&fs->stats.compressed);
 }
 
-int vtfs_storage_rmdir(vtfs_ino_t parent, const char* name) {
-  struct vtfs_ram_node** cur = &vtfs_nodes_head;
+// a private page is cold once a whole scan interval passed without it being read or written;
+// scans up to VTFS_SCAN_BATCH pages from *start on and returns true once the file is done
+static bool vtfs_scan_file(
+    struct vtfs_inode_payload* inode, unsigned long* start, bool compress, bool dedup
+) {
+  if (inode->type != VTFS_NODE_FILE || !down_write_trylock(&inode->rwsem)) {
+    return true;
+  }
 
-  while (*cur) {
-    if ((*cur)->parent_ino == parent && !strcmp((*cur)->name, name)) {
-      if ((*cur)->inode->meta.type != VTFS_NODE_DIR) {
-        LOG("rmdir failed: '%s' is not a directory\n", name);
-        return -ENOTDIR;
-      }
+  bool done = true;
+  unsigned int nr = 0;
+  void* entry;
+  unsigned long index;
+  xa_for_each_start(&inode->pages, index, entry, *start) {
+    if (nr++ == VTFS_SCAN_BATCH) {
+      *start = index;
+      done = false;
+      break;
+    }
 
-      struct vtfs_ram_node* scan = vtfs_nodes_head;
-      while (scan) {
-        if (scan->parent_ino == (*cur)->inode->meta.ino) {
-          LOG("rmdir failed: '%s' is not empty\n", name);
-          return -ENOTEMPTY;
-        }
-        scan = scan->next;
-      }
+    struct vtfs_ram_block* block = NULL;
+    if (vtfs_is_block(entry)) {
+      block = xa_untag_pointer(entry);
+    } else if (!vtfs_is_image(entry) && !TestClearPageReferenced(entry)) {
+      // compression works on blocks, so without it only pages with a twin are frozen
+      block = vtfs_freeze_page(inode, index, entry, dedup, compress);
+    }
 
-      struct vtfs_ram_node* victim = *cur;
-      *cur = victim->next;
+    if (block && compress) {
+      vtfs_compress_block(inode->fs, block);
+    }
+    cond_resched();
+  }
+  up_write(&inode->rwsem);
+  return done;
+}
 
-      vtfs_ino_t parent_ino = victim->parent_ino;
-      struct vtfs_inode_payload* parent_payload = vtfs_find_inode(parent_ino);
-      if (parent_payload && parent_payload->meta.nlink > 0) {
-        parent_payload->meta.nlink--;
-      }
+static void vtfs_schedule_scan(struct vtfs_ram_fs* fs) {
+  unsigned long delay = max(READ_ONCE(vtfs_scan_interval), 1u) * HZ;
+  queue_delayed_work(system_unbound_wq, &fs->scan_work, delay);
+}
 
-      LOG("rmdir success: '%s' (ino=%lu)\n", name, (unsigned long)(*cur)->inode->meta.ino);
-      victim->inode->meta.nlink -= 2;
-      if (victim->inode->meta.nlink <= 0) {
-        vtfs_free_payload(victim->inode);
+static void vtfs_scan_work_fn(struct work_struct* work) {
+  struct vtfs_ram_fs* fs = container_of(to_delayed_work(work), struct vtfs_ram_fs, scan_work);
+  bool compress = READ_ONCE(vtfs_compress);
+  bool dedup = READ_ONCE(vtfs_dedup);
+
+  if (dedup && !fs->dedup_seen) {
+    fs->dedup_seen = bitmap_zalloc(VTFS_DEDUP_SEEN_BITS, GFP_KERNEL | __GFP_NOWARN);
+  }
+  if (compress || dedup) {
+    if (fs->dedup_seen) {
+      bitmap_zero(fs->dedup_seen, VTFS_DEDUP_SEEN_BITS);
+    }
+    fs->scan_gen++;
+    unsigned long ino = VTFS_ROOT_INO;
+    unsigned long index = 0;
+    // the quiesce is dropped between batches, so a checkpoint waits for one batch and not for
+    // the whole tree; the scan resumes at the page it stopped at
+    percpu_down_read(&fs->quiesce);
+    while (xa_find(&fs->inodes, &ino, ULONG_MAX, XA_PRESENT)) {
+      struct vtfs_inode_payload* inode = vtfs_grab_payload(fs, ino);
+      bool done = true;
+      if (inode) {
+        done = vtfs_scan_file(inode, &index, compress, dedup);
+        vtfs_put_payload(inode);
+      }
+      if (done) {
+        ino++;
+        index = 0;
       }
+      percpu_up_read(&fs->quiesce);
+      cond_resched();
+      percpu_down_read(&fs->quiesce);
+    }
+    percpu_up_read(&fs->quiesce);
+  }
+  vtfs_schedule_scan(fs);
+}
+
+static int vtfs_ram_stats_show(struct seq_file* m, void* v) {
+  struct vtfs_ram_fs* fs = m->private;
+  s64 chunks = atomic64_read(&fs->stats.chunks);
+  s64 bytes = atomic64_read(&fs->stats.bytes);
+  s64 decompressed = atomic64_read(&fs->stats.decompressed);
+  s64 ratio = bytes ? div64_s64(chunks * (s64)PAGE_SIZE * 100, bytes) : 0;
+
+  seq_printf(m, "blocks: %lld\n", atomic64_read(&fs->stats.blocks));
+  seq_printf(m, "dedup_saved_pages: %lld\n", atomic64_read(&fs->stats.dedup_saved));
+  seq_printf(m, "dedup_hits: %lld\n", atomic64_read(&fs->stats.dedup_hits));
+  seq_printf(m, "cow_copies: %lld\n", atomic64_read(&fs->stats.cow_copies));
+  seq_printf(m, "compressed_pages: %lld\n", chunks);
+  seq_printf(m, "compressed_bytes: %lld\n", bytes);
+  seq_printf(m, "compression_ratio_x100: %lld\n", ratio);
+  seq_printf(m, "compressions: %lld\n", atomic64_read(&fs->stats.compressed));
+  seq_printf(m, "incompressible: %lld\n", atomic64_read(&fs->stats.incompressible));
+  seq_printf(m, "decompressions: %lld\n", decompressed);
+  seq_printf(
+      m,
+      "decompress_avg_ns: %lld\n",
+      decompressed ? div64_s64(atomic64_read(&fs->stats.decompress_ns), decompressed) : 0
+  );
+  seq_printf(m, "image_faults: %lld\n", atomic64_read(&fs->stats.image_faults));
+  seq_printf(m, "wal_records: %lld\n", atomic64_read(&fs->stats.wal_records));
+  seq_printf(m, "wal_commits: %lld\n", atomic64_read(&fs->stats.wal_commits));
+  seq_printf(m, "wal_bytes: %lld\n", atomic64_read(&fs->stats.wal_bytes));
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vtfs_ram_stats);
+
+// growable buffer the image metadata is collected in before it is written
+struct vtfs_image_meta {
+  char* data;
+  size_t len;
+  size_t cap;
+};
+
+static int vtfs_meta_add(struct vtfs_image_meta* meta, const void* rec, size_t len) {
+  if (meta->len + len > meta->cap) {
+    size_t cap = max(meta->cap * 2, meta->len + len + PAGE_SIZE);
+    char* data = kvrealloc(meta->data, cap, GFP_KERNEL);
+    if (!data) {
+      return -ENOMEM;
+    }
+    meta->data = data;
+    meta->cap = cap;
+  }
+  memcpy(meta->data + meta->len, rec, len);
+  meta->len += len;
+  return 0;
+}
 
-      kfree(victim);
-      return 0;
+static int vtfs_image_write(struct file* file, const void* buf, size_t len, loff_t pos) {
+  while (len) {
+    ssize_t n = kernel_write(file, buf, len, &pos);
+    if (n <= 0) {
+      return n < 0 ? n : -EIO;
     }
-    cur = &(*cur)->next;
+    buf += n;
+    len -= n;
   }
+  return 0;
+}
 
-  return -ENOENT;
+static int vtfs_image_read(struct file* file, void* buf, size_t len, loff_t pos) {
+  while (len) {
+    ssize_t n = kernel_read(file, buf, len, &pos);
+    if (n <= 0) {
+      return n < 0 ? n : -EUCLEAN;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
 }
 
-// --- file r/w ---
-int vtfs_storage_link(
-    vtfs_ino_t parent, const char* name, vtfs_ino_t target_ino, struct vtfs_node_meta* out
+// records the first failure of the log; caller holds wal_lock
+static void vtfs_wal_fail(struct vtfs_ram_fs* fs, int err) {
+  if (!fs->wal_err) {
+    LOG("wal: error %d, changes are not logged until the next checkpoint\n", err);
+    fs->wal_err = err;
+  }
+}
+
+// appends a record of a change the caller has just made, under the locks that ordered it
+static int vtfs_wal_commit(struct vtfs_ram_fs* fs, u64 seq);
+
+// a record is at most a header, a name and VTFS_WAL_DATA_MAX of data, which always fits in an
+// empty batch
+static void vtfs_wal_log(
+    struct vtfs_ram_fs* fs,
+    struct vtfs_wal_record* rec,
+    enum vtfs_wal_op op,
+    const char* name,
+    struct iov_iter* data
 ) {
-  if (vtfs_find_dentry(parent, name)) {
-    return -EEXIST;
+  if (!fs->wal_file) {
+    return;  // no log, or it is being replayed
   }
 
-  struct vtfs_inode_payload* parent_payload = vtfs_find_inode(parent);
-  if (!parent_payload || parent_payload->meta.type != VTFS_NODE_DIR) {
-    return -ENOTDIR;
+  size_t name_len = name ? strlen(name) : 0;
+  size_t data_len = data ? iov_iter_count(data) : 0;
+  size_t len = sizeof(*rec) + name_len + data_len;
+  rec->len = cpu_to_le32(len);
+  rec->op = cpu_to_le16(op);
+  rec->name_len = cpu_to_le16(name_len);
+
+  mutex_lock(&fs->wal_lock);
+  // backpressure: a writer that outruns the log writes the batch out itself, with the locks
+  // that order its change still held, instead of the batch growing
+  while (!fs->wal_err && fs->wal_len + len > VTFS_WAL_BATCH_MAX) {
+    mutex_unlock(&fs->wal_lock);
+    vtfs_wal_commit(fs, U64_MAX);
+    mutex_lock(&fs->wal_lock);
+  }
+  if (fs->wal_err) {
+    mutex_unlock(&fs->wal_lock);
+    return;
   }
 
-  struct vtfs_inode_payload* target = vtfs_find_inode(target_ino);
-  if (!target) {
-    return -ENOENT;
+  rec->seq = cpu_to_le64(++fs->wal_seq);
+  char* p = fs->wal_buf + fs->wal_len;
+  memcpy(p, rec, sizeof(*rec));
+  if (name_len) {
+    memcpy(p + sizeof(*rec), name, name_len);
   }
-  if (target->meta.type != VTFS_NODE_FILE) {
-    return -EPERM;
+  if (data_len) {
+    copy_from_iter(p + sizeof(*rec) + name_len, data_len, data);
   }
+  put_unaligned_le32(crc32_le(~0, p + sizeof(rec->crc), len - sizeof(rec->crc)), p);
+  fs->wal_len += len;
+  bool full = fs->wal_len >= VTFS_WAL_BATCH_MAX / 2;
+  mutex_unlock(&fs->wal_lock);
+
+  atomic64_inc(&fs->stats.wal_records);
+  if (full) {
+    mod_delayed_work(system_unbound_wq, &fs->wal_work, 0);
+  } else {
+    unsigned long delay = msecs_to_jiffies(READ_ONCE(vtfs_wal_commit_ms));
+    queue_delayed_work(system_unbound_wq, &fs->wal_work, delay);
+  }
+}
 
-  struct vtfs_ram_node* node = vtfs_alloc_node();
-  if (!node) {
-    return -ENOMEM;
+// logs a change to the name of inode in the directory parent
+static void vtfs_wal_log_name(
+    enum vtfs_wal_op op, vtfs_ino_t parent, const char* name, struct vtfs_inode_payload* inode
+) {
+  struct vtfs_wal_record rec = {
+      .ino = cpu_to_le64(inode->ino),
+      .parent_ino = cpu_to_le64(parent),
+      .mode = cpu_to_le32(inode->mode),
+  };
+  vtfs_wal_log(inode->fs, &rec, op, name, NULL);
+}
+
+// logs a change to an inode; changes to an unlinked inode die with it and are not logged
+static void vtfs_wal_log_inode(
+    struct vtfs_inode_payload* inode,
+    struct vtfs_wal_record* rec,
+    enum vtfs_wal_op op,
+    struct iov_iter* data
+) {
+  if (inode->nlink) {
+    rec->ino = cpu_to_le64(inode->ino);
+    vtfs_wal_log(inode->fs, rec, op, NULL, data);
   }
+}
 
-  node->parent_ino = parent;
-  strncpy(node->name, name, NAME_MAX);
-  node->name[NAME_MAX] = '\0';
-  node->inode = target;
+// logs the data of a write at pos in records of at most VTFS_WAL_DATA_MAX
+static void vtfs_wal_log_write(
+    struct vtfs_inode_payload* inode, loff_t pos, struct iov_iter* data
+) {
+  while (iov_iter_count(data)) {
+    size_t n = min_t(size_t, iov_iter_count(data), VTFS_WAL_DATA_MAX);
+    struct iov_iter chunk = *data;
+    iov_iter_truncate(&chunk, n);
+    struct vtfs_wal_record rec = {.pos = cpu_to_le64(pos)};
+    vtfs_wal_log_inode(inode, &rec, VTFS_WAL_WRITE, &chunk);
+    iov_iter_advance(data, n);
+    pos += n;
+  }
+}
+
+// writes out every record appended so far and syncs the log; caller holds wal_flush_lock
+static int vtfs_wal_write_out(struct vtfs_ram_fs* fs) {
+  mutex_lock(&fs->wal_lock);
+  swap(fs->wal_buf, fs->wal_spare);
+  size_t len = fs->wal_len;
+  u64 seq = fs->wal_seq;
+  int err = fs->wal_err;
+  fs->wal_len = 0;
+  mutex_unlock(&fs->wal_lock);
+
+  if (!err && len) {
+    err = vtfs_image_write(fs->wal_file, fs->wal_spare, len, fs->wal_size);
+    if (!err) {
+      err = vfs_fsync(fs->wal_file, 1);
+    }
+    if (err) {
+      mutex_lock(&fs->wal_lock);
+      vtfs_wal_fail(fs, err);
+      mutex_unlock(&fs->wal_lock);
+    } else {
+      fs->wal_size += len;
+      fs->wal_synced_seq = seq;
+      atomic64_inc(&fs->stats.wal_commits);
+      atomic64_add(len, &fs->stats.wal_bytes);
+    }
+  }
+  return err;
+}
 
-  target->meta.nlink++;
+// makes every record up to seq durable. Whoever gets the flush lock first writes the records of
+// everyone waiting behind it, so concurrent fsyncs share one write and sync of the log.
+static int vtfs_wal_commit(struct vtfs_ram_fs* fs, u64 seq) {
+  mutex_lock(&fs->wal_flush_lock);
+  int err = fs->wal_synced_seq >= seq ? 0 : vtfs_wal_write_out(fs);
+  mutex_unlock(&fs->wal_flush_lock);
+  return err;
+}
 
-  vtfs_fill_meta(out, node);
-  return 0;
+// the image now holds every change up to seq, the log can start over
+static void vtfs_wal_reset(struct vtfs_ram_fs* fs, u64 seq) {
+  mutex_lock(&fs->wal_flush_lock);
+  mutex_lock(&fs->wal_lock);
+  fs->wal_len = 0;
+  fs->wal_err = 0;
+  mutex_unlock(&fs->wal_lock);
+
+  // if this fails the old records stay in front of the new ones; replay skips them by seq
+  int err = vfs_truncate(&fs->wal_file->f_path, 0);
+  if (err) {
+    LOG("wal: truncate failed: %d\n", err);
+  } else {
+    fs->wal_size = 0;
+  }
+  fs->wal_synced_seq = seq;
+  fs->wal_compact_at = 0;
+  mutex_unlock(&fs->wal_flush_lock);
 }
 
-static int vtfs_reserve_data(struct vtfs_inode_payload* inode, size_t needed) {
-  size_t new_cap = max_t(size_t, 2 * inode->capacity, needed);
-  char* new_data = krealloc(inode->data, new_cap, GFP_KERNEL);
-  if (!new_data) {
-    return -ENOMEM;
+static int vtfs_checkpoint(struct vtfs_ram_fs* fs);
+
+static void vtfs_wal_work_fn(struct work_struct* work) {
+  struct vtfs_ram_fs* fs = container_of(to_delayed_work(work), struct vtfs_ram_fs, wal_work);
+  vtfs_wal_commit(fs, U64_MAX);
+
+  loff_t max_size = (loff_t)READ_ONCE(vtfs_wal_max_mb) << 20;
+  mutex_lock(&fs->wal_flush_lock);
+  bool compact = max_size && fs->wal_size >= max(max_size, fs->wal_compact_at);
+  mutex_unlock(&fs->wal_flush_lock);
+  if (!compact) {
+    return;
   }
 
-  if (new_cap > inode->capacity) {
-    memset(new_data + inode->capacity, 0, new_cap - inode->capacity);
+  int err = vtfs_checkpoint(fs);
+  if (err) {
+    LOG("wal: compaction failed: %d\n", err);
+    // try again once the log has grown by another wal_max_mb
+    mutex_lock(&fs->wal_flush_lock);
+    fs->wal_compact_at = fs->wal_size + max_size;
+    mutex_unlock(&fs->wal_flush_lock);
   }
+}
 
-  inode->data = new_data;
-  inode->capacity = new_cap;
+struct vtfs_ckpt {
+  struct vtfs_ram_fs* fs;
+  struct file* file;
+  struct vtfs_image_meta meta;
+  char* buf;  // one page
+  struct xarray moved;  // slot in the previous image -> slot in this one
+  u64 nr_slots;
+  u64 nr_inodes;
+  u64 nr_dirents;
+  u64 wal_seq;
+};
 
+// appends the page in ck->buf to the data segment
+static int vtfs_ckpt_write_slot(struct vtfs_ckpt* ck, u64* slot) {
+  loff_t pos = PAGE_SIZE + (ck->nr_slots << PAGE_SHIFT);
+  int err = vtfs_image_write(ck->file, ck->buf, PAGE_SIZE, pos);
+  if (err) {
+    return err;
+  }
+  *slot = ck->nr_slots++;
   return 0;
 }
 
-ssize_t vtfs_storage_read_file(vtfs_ino_t ino, loff_t offset, size_t len, char* dst) {
-  struct vtfs_inode_payload* inode = vtfs_find_inode(ino);
-  if (!inode) {
-    return -ENOENT;
+// copies a page that is still in the previous image straight from there into this one, once per
+// slot, so that slots restore shared between files stay shared
+static int vtfs_ckpt_copy_slot(struct vtfs_ckpt* ck, void* entry, u64* slot) {
+  u64 from = vtfs_image_slot(entry);
+  void* moved = xa_load(&ck->moved, from);
+  if (moved) {
+    *slot = xa_to_value(moved);
+    return 0;
+  }
+
+  struct file* file = ck->fs->image_file[vtfs_image_which(entry)];
+  int err = vtfs_image_read(file, ck->buf, PAGE_SIZE, PAGE_SIZE + (from << PAGE_SHIFT));
+  if (!err) {
+    err = vtfs_ckpt_write_slot(ck, slot);
+  }
+  if (!err) {
+    err = xa_err(xa_store(&ck->moved, from, xa_mk_value(*slot), GFP_KERNEL));
   }
+  return err;
+}
 
-  if (inode->meta.type != VTFS_NODE_FILE) {
-    return -EISDIR;
+// writes the data of a file page unless it is a block this checkpoint already wrote
+static int vtfs_ckpt_page(struct vtfs_ckpt* ck, void* entry, u64* slot) {
+  if (vtfs_is_image(entry)) {
+    return vtfs_ckpt_copy_slot(ck, entry, slot);
+  }
+  if (!vtfs_is_block(entry)) {
+    memcpy_from_page(ck->buf, entry, 0, PAGE_SIZE);
+    return vtfs_ckpt_write_slot(ck, slot);
   }
 
-  if (offset >= inode->meta.size) {
+  struct vtfs_ram_block* block = xa_untag_pointer(entry);
+  if (block->ckpt_gen == ck->fs->ckpt_gen) {
+    *slot = block->ckpt_slot;
     return 0;
   }
 
-  size_t to_copy = min_t(size_t, len, inode->meta.size - offset);
-  memcpy(dst, inode->data + offset, to_copy);
-
-  return (ssize_t)to_copy;
+  int err = vtfs_block_read(block, ck->buf);
+  if (!err) {
+    err = vtfs_ckpt_write_slot(ck, slot);
+  }
+  if (!err) {
+    block->ckpt_gen = ck->fs->ckpt_gen;
+    block->ckpt_slot = *slot;
+  }
+  return err;
 }
 
-ssize_t vtfs_storage_write_file(
-    vtfs_ino_t ino, loff_t offset, const char* src, size_t len, loff_t* new_size
-) {
-  struct vtfs_inode_payload* inode = vtfs_find_inode(ino);
-  if (!inode) {
-    return -ENOENT;
+static int vtfs_ckpt_inode(struct vtfs_ckpt* ck, struct vtfs_inode_payload* inode) {
+  struct vtfs_image_inode rec = {
+      .ino = cpu_to_le64(inode->ino),
+      .size = cpu_to_le64(inode->size),
+      .mode = cpu_to_le32(inode->mode),
+      .nlink = cpu_to_le32(inode->nlink),
+      .type = cpu_to_le32(inode->type),
+  };
+  size_t rec_off = ck->meta.len;
+  int err = vtfs_meta_add(&ck->meta, &rec, sizeof(rec));
+  if (err || inode->type != VTFS_NODE_FILE) {
+    return err;
   }
 
-  if (inode->meta.type != VTFS_NODE_FILE) {
-    return -EISDIR;
-  }
+  u64 nr_pages = 0;
+  void* entry;
+  unsigned long index;
+  xa_for_each(&inode->pages, index, entry) {
+    struct vtfs_image_page page_rec = {.index = cpu_to_le64(index)};
+    u64 slot;
 
-  size_t end = offset + len;
-  if (end > inode->capacity) {
-    int err = vtfs_reserve_data(inode, end);
+    err = vtfs_ckpt_page(ck, entry, &slot);
     if (err) {
       return err;
     }
+    page_rec.slot = cpu_to_le64(slot);
+    err = vtfs_meta_add(&ck->meta, &page_rec, sizeof(page_rec));
+    if (err) {
+      return err;
+    }
+    nr_pages++;
+    cond_resched();
   }
 
-  if (offset > inode->meta.size) {
-    memset(inode->data + inode->meta.size, 0, offset - inode->meta.size);
-  }
-
-  memcpy(inode->data + offset, src, len);
-  inode->meta.size = max_t(loff_t, inode->meta.size, end);
+  struct vtfs_image_inode* written = (void*)(ck->meta.data + rec_off);
+  written->nr_pages = cpu_to_le64(nr_pages);
+  return 0;
+}
 
-  if (new_size) {
-    *new_size = inode->meta.size;
+static int vtfs_ckpt_dirents(struct vtfs_ckpt* ck, struct vtfs_inode_payload* dir) {
+  struct vtfs_ram_node* node;
+  unsigned long cookie;
+  xa_for_each(&dir->children, cookie, node) {
+    size_t len = strlen(node->name);
+    struct vtfs_image_dirent rec = {
+        .parent_ino = cpu_to_le64(dir->ino),
+        .ino = cpu_to_le64(node->inode->ino),
+        .name_len = cpu_to_le16(len),
+    };
+    int err = vtfs_meta_add(&ck->meta, &rec, sizeof(rec));
+    if (!err) {
+      err = vtfs_meta_add(&ck->meta, node->name, len);
+    }
+    if (err) {
+      return err;
+    }
+    ck->nr_dirents++;
   }
+  return 0;
+}
 
-  return (ssize_t)len;
+// reads in the pages of unlinked files that are still in the current image; those files aren't
+// written to the new one, and the current one is closed once the new one is complete
+static int vtfs_ckpt_fault_in_orphans(struct vtfs_ram_fs* fs) {
+  struct vtfs_inode_payload* ip;
+  unsigned long ino;
+  xa_for_each(&fs->inodes, ino, ip) {
+    if (ip->type != VTFS_NODE_FILE || ip->nlink) {
+      continue;
+    }
+    down_read(&ip->rwsem);
+    void* entry;
+    unsigned long index;
+    xa_for_each(&ip->pages, index, entry) {
+      if (vtfs_is_image(entry)) {
+        entry = vtfs_fault_in(ip, index, entry);
+        if (IS_ERR(entry)) {
+          up_read(&ip->rwsem);
+          return PTR_ERR(entry);
+        }
+      }
+      cond_resched();
+    }
+    up_read(&ip->rwsem);
+  }
+  return 0;
 }
+
+// points the pages still in the previous image at their copies in the one just written, so the
+// previous one can be overwritten next time. Taking each file's rwsem waits out readers that
+// loaded an entry before and are still reading its slot.
+static void vtfs_ckpt_remap(struct vtfs_ckpt* ck, int target) {
+  struct vtfs_inode_payload* ip;
+  unsigned long ino;
+  xa_for_each(&ck->fs->inodes, ino, ip) {
+    if (ip->type != VTFS_NODE_FILE) {
+      continue;
+    }
+    down_write(&ip->rwsem);
+    void* entry;
+    unsigned long index;
+    xa_for_each(&ip->pages, index, entry) {
+      if (vtfs_is_image(entry)) {
+        u64 slot = xa_to_value(xa_load(&ck->moved, vtfs_image_slot(entry)));
+        // the entry already exists, so this never allocates
+        xa_store(&ip->pages, index, vtfs_mk_image_entry(slot, target), GFP_NOWAIT);
+      }
+      cond_resched();
+    }
+    up_write(&ip->rwsem);
+  }
+}
+
+static int vtfs_ckpt_write(struct vtfs_ckpt* ck) {
+  struct vtfs_ram_fs* fs = ck->fs;
+  struct vtfs_inode_payload* ip;
+  unsigned long ino;
+  int err;
+
+  // inodes and their page maps first, so restore can link directory entries right away; one
+  // without links has no place in the tree and restore would reject it
+  xa_for_each(&fs->inodes, ino, ip) {
+    if (!ip->nlink) {
+      continue;
+    }
+    err = vtfs_ckpt_inode(ck, ip);
+    if (err) {
+      return err;
+    }
+    ck->nr_inodes++;
+  }
+
+  xa_for_each(&fs->inodes, ino, ip) {
+    if (ip->type == VTFS_NODE_DIR && ip->nlink) {
+      err = vtfs_ckpt_dirents(ck, ip);
+      if (err) {
+        return err;
+      }
+    }
+  }
+
+  loff_t meta_off = PAGE_SIZE + (ck->nr_slots << PAGE_SHIFT);
+  err = vtfs_image_write(ck->file, ck->meta.data, ck->meta.len, meta_off);
+  if (err) {
+    return err;
+  }
+
+  // the header goes last, an interrupted checkpoint leaves no valid magic behind
+  struct vtfs_image_header hdr = {
+      .magic = cpu_to_le64(VTFS_IMAGE_MAGIC),
+      .version = cpu_to_le32(VTFS_IMAGE_VERSION),
+      .page_size = cpu_to_le32(PAGE_SIZE),
+      .nr_inodes = cpu_to_le64(ck->nr_inodes),
+      .nr_dirents = cpu_to_le64(ck->nr_dirents),
+      .nr_slots = cpu_to_le64(ck->nr_slots),
+      .data_off = cpu_to_le64(PAGE_SIZE),
+      .meta_off = cpu_to_le64(meta_off),
+      .meta_len = cpu_to_le64(ck->meta.len),
+      .generation = cpu_to_le64(fs->image_gen + 1),
+      .wal_seq = cpu_to_le64(ck->wal_seq),
+  };
+  err = vfs_fsync(ck->file, 0);
+  if (!err) {
+    err = vtfs_image_write(ck->file, &hdr, sizeof(hdr), 0);
+  }
+  if (!err) {
+    err = vfs_fsync(ck->file, 0);
+  }
+  return err;
+}
+
+// checkpoints alternate between image= and image=.1, so a torn one never hits the last good one
+static const char* vtfs_image_name(struct vtfs_ram_fs* fs, int which) {
+  return which ? fs->image_alt : fs->image_path;
+}
+
+static int vtfs_checkpoint(struct vtfs_ram_fs* fs) {
+  if (!fs->image_path) {
+    LOG("checkpoint: no image= path configured\n");
+    return -EINVAL;
+  }
+
+  struct vtfs_ckpt ck = {.fs = fs};
+  ck.buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+  if (!ck.buf) {
+    return -ENOMEM;
+  }
+  xa_init(&ck.moved);
+
+  // writers and the scan worker wait until the image is complete
+  percpu_down_write(&fs->quiesce);
+
+  // picked under the quiesce, two checkpoints in a row must not both overwrite the same file
+  int target = !fs->image_cur;
+  const char* path = vtfs_image_name(fs, target);
+  int err = vtfs_ckpt_fault_in_orphans(fs);
+  if (err) {
+    goto out;
+  }
+
+  // nothing points into the target, pages still in an image are in the current one; readable,
+  // since the pages copied from there will point into it once it is complete
+  ck.file = filp_open(path, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+  if (IS_ERR(ck.file)) {
+    err = PTR_ERR(ck.file);
+    goto out;
+  }
+  if (file_inode(ck.file)->i_sb->s_type == &vtfs_fs_type) {
+    // writing into vtfs itself would wait for the quiesce we hold
+    err = -EINVAL;
+  } else {
+    fs->ckpt_gen++;
+    ck.wal_seq = fs->wal_seq;  // no change is being logged while we hold the quiesce
+    err = vtfs_ckpt_write(&ck);
+  }
+  if (!err && !xa_empty(&ck.moved)) {
+    vtfs_ckpt_remap(&ck, target);
+    fs->image_file[target] = get_file(ck.file);
+  }
+  filp_close(ck.file, NULL);
+
+  if (!err) {
+    if (fs->image_file[fs->image_cur]) {
+      fput(fs->image_file[fs->image_cur]);
+      fs->image_file[fs->image_cur] = NULL;
+    }
+    fs->image_gen++;
+    fs->image_cur = target;
+    if (fs->wal_file) {
+      vtfs_wal_reset(fs, ck.wal_seq);
+    }
+  }
+
+  LOG("checkpoint: %llu inodes, %llu dirents, %llu data pages: %d\n",
+      ck.nr_inodes,
+      ck.nr_dirents,
+      ck.nr_slots,
+      err);
+out:
+  percpu_up_write(&fs->quiesce);
+  xa_destroy(&ck.moved);
+  kvfree(ck.meta.data);
+  kfree(ck.buf);
+  return err;
+}
+
+static int vtfs_ram_checkpoint(struct super_block* sb) {
+  return vtfs_checkpoint(VTFS_RAM(sb));
+}
+
+static int vtfs_ram_sync(struct super_block* sb) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  if (!fs->wal_file) {
+    return 0;
+  }
+
+  mutex_lock(&fs->wal_lock);
+  u64 seq = fs->wal_seq;
+  mutex_unlock(&fs->wal_lock);
+  return vtfs_wal_commit(fs, seq);
+}
+
+// takes the next len bytes of metadata, NULL if the image is truncated
+static const void* vtfs_meta_take(struct vtfs_image_meta* meta, size_t len) {
+  if (meta->cap - meta->len < len) {
+    return NULL;
+  }
+  const void* p = meta->data + meta->len;
+  meta->len += len;
+  return p;
+}
+
+static int vtfs_restore_inode(
+    struct vtfs_ram_fs* fs, struct vtfs_image_meta* meta, int which, u64 nr_slots, bool* lazy
+) {
+  struct vtfs_image_inode rec;
+  const void* p = vtfs_meta_take(meta, sizeof(rec));
+  if (!p) {
+    return -EUCLEAN;
+  }
+  memcpy(&rec, p, sizeof(rec));
+
+  u32 type = le32_to_cpu(rec.type);
+  u64 ino = le64_to_cpu(rec.ino);
+  u32 nlink = le32_to_cpu(rec.nlink);
+  if ((type != VTFS_NODE_DIR && type != VTFS_NODE_FILE) || !ino || ino > U32_MAX || !nlink) {
+    return -EUCLEAN;
+  }
+
+  struct vtfs_inode_payload* inode = vtfs_alloc_payload(fs, type, le32_to_cpu(rec.mode), ino);
+  if (IS_ERR(inode)) {
+    return PTR_ERR(inode) == -EBUSY ? -EUCLEAN : PTR_ERR(inode);
+  }
+  inode->size = le64_to_cpu(rec.size);
+  inode->nlink = nlink;
+
+  u64 nr_pages = le64_to_cpu(rec.nr_pages);
+  if (type == VTFS_NODE_DIR && nr_pages) {
+    return -EUCLEAN;
+  }
+  for (u64 i = 0; i < nr_pages; i++) {
+    struct vtfs_image_page page_rec;
+    p = vtfs_meta_take(meta, sizeof(page_rec));
+    if (!p) {
+      return -EUCLEAN;
+    }
+    memcpy(&page_rec, p, sizeof(page_rec));
+
+    u64 index = le64_to_cpu(page_rec.index);
+    u64 slot = le64_to_cpu(page_rec.slot);
+    if (slot >= nr_slots || index > (MAX_LFS_FILESIZE >> PAGE_SHIFT)) {
+      return -EUCLEAN;
+    }
+    int err =
+        xa_insert(&inode->pages, index, vtfs_mk_image_entry(slot, which), GFP_KERNEL_ACCOUNT);
+    if (err) {
+      return err == -EBUSY ? -EUCLEAN : err;
+    }
+    percpu_counter_inc(&fs->used_blocks);
+    *lazy = true;
+  }
+  return 0;
+}
+
+static int vtfs_restore_dirent(struct vtfs_ram_fs* fs, struct vtfs_image_meta* meta) {
+  struct vtfs_image_dirent rec;
+  char name[NAME_MAX + 1];
+
+  const void* p = vtfs_meta_take(meta, sizeof(rec));
+  if (!p) {
+    return -EUCLEAN;
+  }
+  memcpy(&rec, p, sizeof(rec));
+
+  size_t len = le16_to_cpu(rec.name_len);
+  p = len && len <= NAME_MAX ? vtfs_meta_take(meta, len) : NULL;
+  if (!p) {
+    return -EUCLEAN;
+  }
+  memcpy(name, p, len);
+  name[len] = '\0';
+  if (strnlen(name, len) != len || strchr(name, '/')) {
+    return -EUCLEAN;
+  }
+
+  vtfs_ino_t parent_ino = le64_to_cpu(rec.parent_ino);
+  struct vtfs_inode_payload* parent = xa_load(&fs->inodes, parent_ino);
+  struct vtfs_inode_payload* inode = xa_load(&fs->inodes, le64_to_cpu(rec.ino));
+  if (!parent || parent->type != VTFS_NODE_DIR || !inode) {
+    return -EUCLEAN;
+  }
+
+  struct vtfs_ram_node* node = vtfs_alloc_node(parent_ino, name, inode);
+  if (!node) {
+    return -ENOMEM;
+  }
+  mutex_lock(&parent->dir_mutex);
+  int err = vtfs_attach_node(parent, node);
+  mutex_unlock(&parent->dir_mutex);
+  if (err) {
+    vtfs_free_node(node);
+    return err == -EEXIST ? -EUCLEAN : err;
+  }
+  return 0;
+}
+
+// opens an image and checks its header; -EUCLEAN if it is not a complete image
+static struct file* vtfs_image_open(const char* path, struct vtfs_image_header* hdr) {
+  struct file* file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+  if (IS_ERR(file)) {
+    return file;
+  }
+
+  int err = vtfs_image_read(file, hdr, sizeof(*hdr), 0);
+  if (err) {
+    fput(file);
+    return ERR_PTR(err);
+  }
+
+  u64 nr_slots = le64_to_cpu(hdr->nr_slots);
+  u64 meta_off = le64_to_cpu(hdr->meta_off);
+  u64 file_size = i_size_read(file_inode(file));
+  if (le64_to_cpu(hdr->magic) != VTFS_IMAGE_MAGIC ||
+      le32_to_cpu(hdr->version) != VTFS_IMAGE_VERSION ||
+      le32_to_cpu(hdr->page_size) != PAGE_SIZE || le64_to_cpu(hdr->data_off) != PAGE_SIZE ||
+      nr_slots > (MAX_LFS_FILESIZE >> PAGE_SHIFT) ||
+      meta_off != PAGE_SIZE + (nr_slots << PAGE_SHIFT) || meta_off > file_size ||
+      le64_to_cpu(hdr->meta_len) > file_size - meta_off) {
+    fput(file);
+    return ERR_PTR(-EUCLEAN);
+  }
+  return file;
+}
+
+// rebuilds the tree from an image; file data stays in the image until it is first used
+static int vtfs_restore_image(
+    struct vtfs_ram_fs* fs, int which, struct file* file, const struct vtfs_image_header* hdr
+) {
+  struct vtfs_image_meta meta = {};
+  u64 nr_slots = le64_to_cpu(hdr->nr_slots);
+  u64 meta_len = le64_to_cpu(hdr->meta_len);
+  bool lazy = false;
+
+  meta.data = kvmalloc(meta_len, GFP_KERNEL);
+  if (!meta.data) {
+    return -ENOMEM;
+  }
+  meta.cap = meta_len;
+  int err = vtfs_image_read(file, meta.data, meta_len, le64_to_cpu(hdr->meta_off));
+
+  for (u64 i = 0; i < le64_to_cpu(hdr->nr_inodes) && !err; i++) {
+    err = vtfs_restore_inode(fs, &meta, which, nr_slots, &lazy);
+    cond_resched();
+  }
+  for (u64 i = 0; i < le64_to_cpu(hdr->nr_dirents) && !err; i++) {
+    err = vtfs_restore_dirent(fs, &meta);
+    cond_resched();
+  }
+
+  struct vtfs_inode_payload* root = xa_load(&fs->inodes, VTFS_ROOT_INO);
+  if (!err && (!root || root->type != VTFS_NODE_DIR)) {
+    err = -EUCLEAN;
+  }
+
+  if (!err && lazy) {
+    fs->image_file[which] = get_file(file);
+  }
+  LOG("restore: %llu inodes, %llu dirents, generation %llu: %d\n",
+      le64_to_cpu(hdr->nr_inodes),
+      le64_to_cpu(hdr->nr_dirents),
+      le64_to_cpu(hdr->generation),
+      err);
+  kvfree(meta.data);
+  return err;
+}
+
+// restores the newest complete image of the two that checkpoints alternate between
+static int vtfs_restore(struct vtfs_ram_fs* fs) {
+  struct vtfs_image_header hdr[2];
+  struct file* file[2];
+  int best = -1;
+  int err = -ENOENT;
+
+  for (int i = 0; i < 2; i++) {
+    file[i] = vtfs_image_open(vtfs_image_name(fs, i), &hdr[i]);
+    if (IS_ERR(file[i])) {
+      // a broken image is only fatal if there is no good one to fall back to
+      if (err == -ENOENT) {
+        err = PTR_ERR(file[i]);
+      }
+      continue;
+    }
+    if (best < 0 || le64_to_cpu(hdr[i].generation) > le64_to_cpu(hdr[best].generation)) {
+      best = i;
+    }
+  }
+
+  if (best >= 0) {
+    err = vtfs_restore_image(fs, best, file[best], &hdr[best]);
+    if (!err) {
+      fs->image_cur = best;
+      fs->image_gen = le64_to_cpu(hdr[best].generation);
+      fs->wal_seq = le64_to_cpu(hdr[best].wal_seq);
+    }
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (!IS_ERR(file[i])) {
+      fput(file[i]);
+    }
+  }
+  return err;
+}
+
+static int vtfs_wal_open(struct super_block* sb);
+
+static int vtfs_ram_init(void) {
+  LOG("storage_init\n");
+
+  // SLAB_ACCOUNT and __GFP_ACCOUNT charge everything a tenant creates to its memory cgroup
+  vtfs_payload_cache = KMEM_CACHE(vtfs_inode_payload, SLAB_ACCOUNT);
+  vtfs_node_cache = KMEM_CACHE(vtfs_ram_node, SLAB_ACCOUNT);
+  if (!vtfs_payload_cache || !vtfs_node_cache) {
+    kmem_cache_destroy(vtfs_node_cache);
+    kmem_cache_destroy(vtfs_payload_cache);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+static void vtfs_ram_shutdown(void) {
+  // wait for the RCU callbacks that free nodes and payloads back into the caches
+  rcu_barrier();
+  kmem_cache_destroy(vtfs_node_cache);
+  kmem_cache_destroy(vtfs_payload_cache);
+  LOG("vtfs_ram_shutdown\n");
+}
+
+// an option that was opened at mount may be repeated on remount, but not changed
+static bool vtfs_path_changed(const char* opt, const char* cur) {
+  return opt && (!cur || strcmp(opt, cur));
+}
+
+static int vtfs_ram_configure(struct super_block* sb, const struct vtfs_mount_opts* opts) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  u64 max_blocks = fs->max_blocks;
+  u64 max_inodes = fs->max_inodes;
+
+  if (opts->server || opts->token || opts->rpc_chunk != VTFS_OPT_UNSET ||
+      opts->conns != VTFS_OPT_UNSET) {
+    LOG("configure: server options are not supported by this backend\n");
+    return -EINVAL;
+  }
+  if (vtfs_path_changed(opts->image, fs->image_path) ||
+      vtfs_path_changed(opts->wal, fs->wal_path)) {
+    LOG("configure: image= and wal= can't change on remount\n");
+    return -EINVAL;
+  }
+
+  if (opts->max_bytes != VTFS_OPT_UNSET) {
+    max_blocks = DIV_ROUND_UP(opts->max_bytes, PAGE_SIZE);
+  }
+  if (opts->max_inodes != VTFS_OPT_UNSET) {
+    max_inodes = opts->max_inodes;
+  }
+
+  // like tmpfs, refuse a limit below what is already in use
+  if ((max_blocks && percpu_counter_compare(&fs->used_blocks, max_blocks) > 0) ||
+      (max_inodes && percpu_counter_compare(&fs->used_inodes, max_inodes) > 0)) {
+    return -EINVAL;
+  }
+
+  fs->max_blocks = max_blocks;
+  fs->max_inodes = max_inodes;
+  LOG("configure: max_blocks=%llu max_inodes=%llu\n", max_blocks, max_inodes);
+  return 0;
+}
+
+// frees the tree of a mount and the tables indexing it; nothing else may touch it anymore
+static void vtfs_destroy_tree(struct vtfs_ram_fs* fs) {
+  vtfs_free_all_nodes(fs);
+  for (int i = 0; i < 2; i++) {
+    if (fs->image_file[i]) {
+      fput(fs->image_file[i]);
+      fs->image_file[i] = NULL;
+    }
+  }
+  rhashtable_destroy(&fs->blocks);
+  rhashtable_destroy(&fs->dentries);
+}
+
+static void vtfs_free_fs(struct vtfs_ram_fs* fs) {
+  kvfree(fs->wal_buf);
+  kvfree(fs->wal_spare);
+  mutex_destroy(&fs->wal_flush_lock);
+  mutex_destroy(&fs->wal_lock);
+  percpu_free_rwsem(&fs->quiesce);
+  percpu_counter_destroy(&fs->used_inodes);
+  percpu_counter_destroy(&fs->used_blocks);
+  kfree(fs->scratch);
+  bitmap_free(fs->dedup_seen);
+  kfree(fs->lz4_buf);
+  kvfree(fs->lz4_wrkmem);
+  kfree(fs->wal_path);
+  kfree(fs->image_alt);
+  kfree(fs->image_path);
+  kfree(fs);
+}
+
+// the files a mount writes: its two images and its log
+static void vtfs_ram_paths(struct vtfs_ram_fs* fs, const char* paths[3]) {
+  paths[0] = fs->image_path;
+  paths[1] = fs->image_alt;
+  paths[2] = fs->wal_path;
+}
+
+static bool vtfs_paths_overlap(const char* const a[3], const char* const b[3]) {
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      if (a[i] && b[j] && (a != b || i != j) && !strcmp(a[i], b[j])) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// claims the mount's files; -EBUSY if another live mount, or the mount itself, already writes
+// one of them. Paths are compared as given, not resolved.
+static int vtfs_ram_register(struct vtfs_ram_fs* fs) {
+  const char* mine[3];
+  const char* theirs[3];
+  struct vtfs_ram_fs* other;
+  int err = 0;
+
+  vtfs_ram_paths(fs, mine);
+  if (!fs->image_path) {
+    return 0;
+  }
+  if (vtfs_paths_overlap(mine, mine)) {
+    LOG("wal= can't be one of the image files\n");
+    return -EINVAL;
+  }
+
+  mutex_lock(&vtfs_ram_mounts_lock);
+  list_for_each_entry(other, &vtfs_ram_mounts, mounts) {
+    vtfs_ram_paths(other, theirs);
+    if (vtfs_paths_overlap(mine, theirs)) {
+      LOG("%s or its log is in use by another mount\n", fs->image_path);
+      err = -EBUSY;
+      break;
+    }
+  }
+  if (!err) {
+    list_add(&fs->mounts, &vtfs_ram_mounts);
+  }
+  mutex_unlock(&vtfs_ram_mounts_lock);
+  return err;
+}
+
+static void vtfs_ram_unregister(struct vtfs_ram_fs* fs) {
+  mutex_lock(&vtfs_ram_mounts_lock);
+  list_del_init(&fs->mounts);
+  mutex_unlock(&vtfs_ram_mounts_lock);
+}
+
+// sets up the tree of a new mount, restored from image= and wal= if they are given
+static int vtfs_ram_fill_super(struct super_block* sb, const struct vtfs_mount_opts* opts) {
+  // the log is also compacted from a worker, relative paths would depend on who resolves them
+  if ((opts->image && opts->image[0] != '/') || (opts->wal && opts->wal[0] != '/')) {
+    LOG("image= and wal= take absolute paths\n");
+    return -EINVAL;
+  }
+  if (opts->wal && !opts->image) {
+    LOG("wal= needs an image= to compact the log into\n");
+    return -EINVAL;
+  }
+
+  struct vtfs_ram_fs* fs = kzalloc(sizeof(*fs), GFP_KERNEL);
+  if (!fs) {
+    return -ENOMEM;
+  }
+  xa_init_flags(&fs->inodes, XA_FLAGS_ALLOC1);
+  fs->max_blocks = totalram_pages() / 2;
+  fs->max_inodes = totalram_pages() / 2;
+  fs->image_cur = 1;
+  mutex_init(&fs->wal_lock);
+  mutex_init(&fs->wal_flush_lock);
+  INIT_DELAYED_WORK(&fs->scan_work, vtfs_scan_work_fn);
+  INIT_DELAYED_WORK(&fs->wal_work, vtfs_wal_work_fn);
+  INIT_LIST_HEAD(&fs->mounts);
+
+  // restore and replay go through the same calls as later changes, which find fs in sb
+  VTFS_SB(sb)->storage = fs;
+
+  int err = -ENOMEM;
+  fs->image_path = kstrdup(opts->image, GFP_KERNEL);
+  fs->image_alt = opts->image ? kasprintf(GFP_KERNEL, "%s.1", opts->image) : NULL;
+  fs->wal_path = kstrdup(opts->wal, GFP_KERNEL);
+  fs->lz4_wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+  fs->lz4_buf = kmalloc(VTFS_LZ4_MAX_LEN, GFP_KERNEL);
+  fs->scratch = kmalloc(PAGE_SIZE, GFP_KERNEL);
+  if ((opts->image && (!fs->image_path || !fs->image_alt)) || (opts->wal && !fs->wal_path) ||
+      !fs->lz4_wrkmem || !fs->lz4_buf || !fs->scratch ||
+      percpu_counter_init(&fs->used_blocks, 0, GFP_KERNEL) ||
+      percpu_counter_init(&fs->used_inodes, 0, GFP_KERNEL) || percpu_init_rwsem(&fs->quiesce)) {
+    goto out_free;
+  }
+
+  // before anything is read, a second mount replaying the same log would fork it
+  err = vtfs_ram_register(fs);
+  if (err) {
+    goto out_free;
+  }
+
+  err = rhashtable_init(&fs->dentries, &vtfs_dentry_params);
+  if (err) {
+    goto out_free;
+  }
+  err = rhashtable_init(&fs->blocks, &vtfs_block_params);
+  if (err) {
+    rhashtable_destroy(&fs->dentries);
+    goto out_free;
+  }
+
+  if (fs->image_path) {
+    err = vtfs_restore(fs);
+    if (err == -ENOENT) {
+      LOG("no image at %s yet, starting empty\n", fs->image_path);
+    } else if (err) {
+      // refuse to start empty over an image that would be overwritten by the next checkpoint
+      LOG("restore from %s failed: %d\n", fs->image_path, err);
+      goto out_tree;
+    }
+  }
+
+  if (!xa_load(&fs->inodes, VTFS_ROOT_INO)) {
+    struct vtfs_inode_payload* root_inode =
+        vtfs_alloc_payload(fs, VTFS_NODE_DIR, S_IFDIR | 0777, 0);
+    if (IS_ERR(root_inode)) {
+      err = PTR_ERR(root_inode);
+      goto out_tree;
+    }
+    LOG("root created: ino=%lu\n", (unsigned long)root_inode->ino);
+  }
+
+  if (fs->wal_path) {
+    err = vtfs_wal_open(sb);
+    if (err) {
+      LOG("replaying %s failed: %d\n", fs->wal_path, err);
+      goto out_tree;
+    }
+  }
+
+  // the limits are checked against what the image and the log brought back
+  err = vtfs_ram_configure(sb, opts);
+  if (err) {
+    goto out_tree;
+  }
+
+  fs->stats_dentry = debugfs_create_file(
+      "ram_stats", 0444, VTFS_SB(sb)->debugfs_dir, fs, &vtfs_ram_stats_fops
+  );
+  vtfs_schedule_scan(fs);
+  return 0;
+
+out_tree:
+  // nothing was logged yet, so there is no commit pending
+  if (fs->wal_file) {
+    fput(fs->wal_file);
+  }
+  vtfs_destroy_tree(fs);
+out_free:
+  vtfs_ram_unregister(fs);
+  VTFS_SB(sb)->storage = NULL;
+  vtfs_free_fs(fs);
+  return err;
+}
+
+static void vtfs_ram_kill_sb(struct super_block* sb) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  if (!fs) {
+    return;  // fill_super failed and cleaned up after itself
+  }
+
+  debugfs_remove(fs->stats_dentry);
+  cancel_delayed_work_sync(&fs->scan_work);
+  if (fs->wal_file) {
+    cancel_delayed_work_sync(&fs->wal_work);
+    vtfs_wal_commit(fs, U64_MAX);
+    fput(fs->wal_file);
+  }
+  vtfs_destroy_tree(fs);
+  // the files are closed, another mount may take them now
+  vtfs_ram_unregister(fs);
+  VTFS_SB(sb)->storage = NULL;
+  vtfs_free_fs(fs);
+  LOG("kill_sb: all nodes freed\n");
+}
+
+
+static int vtfs_ram_statfs(struct super_block* sb, struct kstatfs* buf) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  buf->f_bsize = PAGE_SIZE;
+  buf->f_frsize = PAGE_SIZE;
+  buf->f_namelen = NAME_MAX;
+
+  if (fs->max_blocks) {
+    u64 used = percpu_counter_sum_positive(&fs->used_blocks);
+    buf->f_blocks = fs->max_blocks;
+    buf->f_bfree = fs->max_blocks - min(used, fs->max_blocks);
+    buf->f_bavail = buf->f_bfree;
+  }
+
+  if (fs->max_inodes) {
+    u64 used = percpu_counter_sum_positive(&fs->used_inodes);
+    buf->f_files = fs->max_inodes;
+    buf->f_ffree = fs->max_inodes - min(used, fs->max_inodes);
+  }
+  return 0;
+}
+
+static void vtfs_fill_meta(
+    struct vtfs_node_meta* out, struct vtfs_inode_payload* inode, vtfs_ino_t parent_ino
+) {
+  out->ino = inode->ino;
+  out->parent_ino = parent_ino;
+  out->type = inode->type;
+  out->mode = READ_ONCE(inode->mode);
+  out->size = READ_ONCE(inode->size);
+  out->nlink = READ_ONCE(inode->nlink);
+}
+
+static int vtfs_ram_get_root(struct super_block* sb, struct vtfs_node_meta* out) {
+  struct vtfs_inode_payload* root = vtfs_grab_payload(VTFS_RAM(sb), VTFS_ROOT_INO);
+  if (!root) {
+    return -ENOENT;
+  }
+  vtfs_fill_meta(out, root, VTFS_ROOT_INO);
+  vtfs_put_payload(root);
+  return 0;
+}
+
+INDIRECT_CALLABLE_SCOPE int vtfs_ram_lookup(
+    struct super_block* sb, vtfs_ino_t parent, const char* name, struct vtfs_node_meta* out
+) {
+  rcu_read_lock();
+  struct vtfs_ram_node* node = vtfs_find_dentry(VTFS_RAM(sb), parent, name);
+  if (node) {
+    vtfs_fill_meta(out, node->inode, parent);
+  }
+  rcu_read_unlock();
+
+  if (!node) {
+    return -ENOENT;
+  }
+
+  return 0;
+}
+
+static int vtfs_ram_iterate_dir(
+    struct super_block* sb, vtfs_ino_t dir_ino, unsigned long* offset, struct vtfs_dirent* out
+) {
+  int ret = 0;
+  rcu_read_lock();
+
+  struct vtfs_inode_payload* dir = xa_load(&VTFS_RAM(sb)->inodes, dir_ino);
+  if (!dir) {
+    ret = -ENOENT;
+    goto out;
+  }
+  if (dir->type != VTFS_NODE_DIR) {
+    ret = -ENOTDIR;
+    goto out;
+  }
+
+  // *offset is the cookie to resume from, so entries added or removed meanwhile don't shift it
+  unsigned long cookie = *offset;
+  struct vtfs_ram_node* node = xa_find(&dir->children, &cookie, ULONG_MAX, XA_PRESENT);
+  if (!node) {
+    ret = 1;
+    goto out;
+  }
+
+  strscpy(out->name, node->name, sizeof(out->name));
+  out->ino = node->inode->ino;
+  out->type = node->inode->type;
+  *offset = cookie + 1;
+
+out:
+  rcu_read_unlock();
+  return ret;
+}
+
+static int vtfs_ram_iterate_dir_plus(
+    struct super_block* sb,
+    vtfs_ino_t dir_ino, unsigned long offset, struct vtfs_dirent_plus* out, int max
+) {
+  return -EOPNOTSUPP;  // iterate_dir and lookup cost no more than a batch here
+}
+
+// takes a reference on a directory and its dir_mutex; the directory must not be removed
+static struct vtfs_inode_payload* vtfs_lock_dir(struct vtfs_ram_fs* fs, vtfs_ino_t ino, int* err) {
+  struct vtfs_inode_payload* dir = vtfs_grab_payload(fs, ino);
+  if (!dir) {
+    *err = -ENOENT;
+    return NULL;
+  }
+
+  if (dir->type != VTFS_NODE_DIR) {
+    vtfs_put_payload(dir);
+    *err = -ENOTDIR;
+    return NULL;
+  }
+
+  percpu_down_read(&fs->quiesce);
+  mutex_lock(&dir->dir_mutex);
+  if (dir->nlink == 0) {
+    // lost a race with rmdir
+    mutex_unlock(&dir->dir_mutex);
+    percpu_up_read(&fs->quiesce);
+    vtfs_put_payload(dir);
+    *err = -ENOENT;
+    return NULL;
+  }
+  return dir;
+}
+
+static void vtfs_unlock_dir(struct vtfs_inode_payload* dir) {
+  mutex_unlock(&dir->dir_mutex);
+  percpu_up_read(&dir->fs->quiesce);
+  vtfs_put_payload(dir);
+}
+
+// creates a new file or directory named name inside parent; ino 0 allocates a new number
+static int vtfs_create_node(
+    struct vtfs_ram_fs* fs,
+    vtfs_ino_t parent,
+    const char* name,
+    enum vtfs_node_type type,
+    umode_t mode,
+    vtfs_ino_t ino,
+    struct vtfs_node_meta* out
+) {
+  int err;
+  struct vtfs_inode_payload* parent_payload = vtfs_lock_dir(fs, parent, &err);
+  if (!parent_payload) {
+    return err;
+  }
+
+  if (vtfs_find_dentry(fs, parent, name)) {
+    err = -EEXIST;
+    goto out_unlock;
+  }
+
+  struct vtfs_inode_payload* payload = vtfs_alloc_payload(fs, type, mode, ino);
+  if (IS_ERR(payload)) {
+    LOG("create: payload allocation failed\n");
+    err = PTR_ERR(payload);
+    goto out_unlock;
+  }
+
+  struct vtfs_ram_node* node = vtfs_alloc_node(parent, name, payload);
+  if (!node) {
+    err = -ENOMEM;
+    goto out_free_payload;
+  }
+
+  err = vtfs_attach_node(parent_payload, node);
+  if (err) {
+    vtfs_free_node(node);
+    goto out_free_payload;
+  }
+
+  if (type == VTFS_NODE_DIR) {
+    down_write(&parent_payload->rwsem);
+    WRITE_ONCE(parent_payload->nlink, parent_payload->nlink + 1);
+    up_write(&parent_payload->rwsem);
+  }
+
+  vtfs_wal_log_name(
+      type == VTFS_NODE_DIR ? VTFS_WAL_MKDIR : VTFS_WAL_CREATE, parent, name, payload
+  );
+  vtfs_fill_meta(out, payload, parent);
+  vtfs_unlock_dir(parent_payload);
+  return 0;
+
+out_free_payload:
+  vtfs_unhash_payload(payload);
+  vtfs_put_payload(payload);
+out_unlock:
+  vtfs_unlock_dir(parent_payload);
+  return err;
+}
+
+static int vtfs_ram_create_file(
+    struct super_block* sb,
+    vtfs_ino_t parent,
+    const char* name,
+    umode_t mode,
+    struct vtfs_node_meta* out
+) {
+  return vtfs_create_node(
+      VTFS_RAM(sb), parent, name, VTFS_NODE_FILE, S_IFREG | (mode & 0777), 0, out
+  );
+}
+
+static void vtfs_ram_evict(struct super_block* sb, vtfs_ino_t ino) {
+  vtfs_forget_payload(VTFS_RAM(sb), ino);
+}
+
+static int vtfs_ram_unlink(struct super_block* sb, vtfs_ino_t parent, const char* name) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  int err;
+  struct vtfs_inode_payload* parent_payload = vtfs_lock_dir(fs, parent, &err);
+  if (!parent_payload) {
+    return err;
+  }
+
+  struct vtfs_ram_node* victim = vtfs_find_dentry(fs, parent, name);
+  if (!victim) {
+    vtfs_unlock_dir(parent_payload);
+    return -ENOENT;
+  }
+
+  struct vtfs_inode_payload* inode = victim->inode;
+  if (inode->type != VTFS_NODE_FILE) {
+    vtfs_unlock_dir(parent_payload);
+    return -EPERM;
+  }
+
+  vtfs_detach_node(parent_payload, victim);
+
+  down_write(&inode->rwsem);
+  vtfs_wal_log_name(VTFS_WAL_UNLINK, parent, name, inode);
+  WRITE_ONCE(inode->nlink, inode->nlink - 1);
+  up_write(&inode->rwsem);
+  // without links the inode stays in the table until vtfs_ram_evict
+  vtfs_unlock_dir(parent_payload);
+
+  call_rcu(&victim->rcu, vtfs_free_node_rcu);
+  return 0;
+}
+
+// --- dirs ---
+static int vtfs_ram_mkdir(
+    struct super_block* sb,
+    vtfs_ino_t parent,
+    const char* name,
+    umode_t mode,
+    struct vtfs_node_meta* out
+) {
+  return vtfs_create_node(
+      VTFS_RAM(sb), parent, name, VTFS_NODE_DIR, S_IFDIR | (mode & 0777), 0, out
+  );
+}
+
+static int vtfs_ram_rmdir(struct super_block* sb, vtfs_ino_t parent, const char* name) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  int err;
+  struct vtfs_inode_payload* parent_payload = vtfs_lock_dir(fs, parent, &err);
+  if (!parent_payload) {
+    return err;
+  }
+
+  struct vtfs_ram_node* victim = vtfs_find_dentry(fs, parent, name);
+  if (!victim) {
+    vtfs_unlock_dir(parent_payload);
+    return -ENOENT;
+  }
+
+  struct vtfs_inode_payload* dir = victim->inode;
+  if (dir->type != VTFS_NODE_DIR) {
+    vtfs_unlock_dir(parent_payload);
+    return -ENOTDIR;
+  }
+
+  mutex_lock_nested(&dir->dir_mutex, SINGLE_DEPTH_NESTING);
+  if (!xa_empty(&dir->children)) {
+    mutex_unlock(&dir->dir_mutex);
+    vtfs_unlock_dir(parent_payload);
+    return -ENOTEMPTY;
+  }
+
+  vtfs_detach_node(parent_payload, victim);
+
+  // nlink == 0 also tells creators waiting on dir_mutex that the directory is gone
+  down_write(&dir->rwsem);
+  vtfs_wal_log_name(VTFS_WAL_RMDIR, parent, name, dir);
+  WRITE_ONCE(dir->nlink, 0);
+  up_write(&dir->rwsem);
+  mutex_unlock(&dir->dir_mutex);
+
+  down_write(&parent_payload->rwsem);
+  if (parent_payload->nlink > 0) {
+    WRITE_ONCE(parent_payload->nlink, parent_payload->nlink - 1);
+  }
+  up_write(&parent_payload->rwsem);
+  vtfs_unlock_dir(parent_payload);
+
+  call_rcu(&victim->rcu, vtfs_free_node_rcu);
+  return 0;
+}
+
+// --- file r/w ---
+static int vtfs_ram_link(
+    struct super_block* sb,
+    vtfs_ino_t parent,
+    const char* name,
+    vtfs_ino_t target_ino,
+    struct vtfs_node_meta* out
+) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  struct vtfs_inode_payload* target = vtfs_grab_payload(fs, target_ino);
+  if (!target) {
+    return -ENOENT;
+  }
+  if (target->type != VTFS_NODE_FILE) {
+    vtfs_put_payload(target);
+    return -EPERM;
+  }
+
+  int err;
+  struct vtfs_inode_payload* parent_payload = vtfs_lock_dir(fs, parent, &err);
+  if (!parent_payload) {
+    vtfs_put_payload(target);
+    return err;
+  }
+
+  if (vtfs_find_dentry(fs, parent, name)) {
+    err = -EEXIST;
+    goto out;
+  }
+
+  struct vtfs_ram_node* node = vtfs_alloc_node(parent, name, target);
+  if (!node) {
+    err = -ENOMEM;
+    goto out;
+  }
+
+  err = vtfs_attach_node(parent_payload, node);
+  if (err) {
+    vtfs_free_node(node);
+    goto out;
+  }
+
+  // the link is logged under the same rwsem as the nlink change, so that an unlink of another
+  // name of target is logged in the same order it was applied
+  down_write(&target->rwsem);
+  if (target->nlink == 0) {
+    // lost a race with the last unlink
+    up_write(&target->rwsem);
+    vtfs_detach_node(parent_payload, node);
+    call_rcu(&node->rcu, vtfs_free_node_rcu);
+    err = -ENOENT;
+    goto out;
+  }
+  WRITE_ONCE(target->nlink, target->nlink + 1);
+  vtfs_wal_log_name(VTFS_WAL_LINK, parent, name, target);
+  up_write(&target->rwsem);
+
+  vtfs_fill_meta(out, target, parent);
+
+out:
+  vtfs_unlock_dir(parent_payload);
+  vtfs_put_payload(target);
+  return err;
+}
+
+// looks up a regular file and takes a reference on it
+static struct vtfs_inode_payload* vtfs_grab_file(struct vtfs_ram_fs* fs, vtfs_ino_t ino, int* err) {
+  struct vtfs_inode_payload* inode = vtfs_grab_payload(fs, ino);
+  if (!inode) {
+    *err = -ENOENT;
+    return NULL;
+  }
+
+  if (inode->type != VTFS_NODE_FILE) {
+    vtfs_put_payload(inode);
+    *err = -EISDIR;
+    return NULL;
+  }
+  return inode;
+}
+
+// the page holding the data at index with an extra reference; NULL for a hole
+static struct page* vtfs_get_read_page(struct vtfs_inode_payload* inode, pgoff_t index) {
+  void* entry = vtfs_load_entry(inode, index);
+  if (IS_ERR(entry)) {
+    return entry;
+  }
+  if (vtfs_is_block(entry)) {
+    return vtfs_block_get_page(inode->fs, xa_untag_pointer(entry));
+  }
+  if (entry) {
+    vtfs_touch_page(entry);
+    get_page(entry);
+  }
+  return entry;
+}
+
+// copies the page at index into dst; holes read as zeroes
+static int vtfs_read_page(
+    struct vtfs_inode_payload* inode, pgoff_t index, size_t offset, size_t len, char* dst
+) {
+  struct page* page = vtfs_get_read_page(inode, index);
+  if (IS_ERR(page)) {
+    return PTR_ERR(page);
+  }
+  if (page) {
+    memcpy_from_page(dst, page, offset, len);
+    put_page(page);
+  } else {
+    memset(dst, 0, len);
+  }
+  return 0;
+}
+
+// the private page at index, copying a block into a new one first; NULL for a hole
+static struct page* vtfs_load_page_for_write(struct vtfs_inode_payload* inode, pgoff_t index) {
+  void* entry = vtfs_load_entry(inode, index);
+  if (IS_ERR(entry)) {
+    return entry;
+  }
+  if (!vtfs_is_block(entry)) {
+    if (entry) {
+      vtfs_touch_page(entry);
+    }
+    return entry;
+  }
+
+  struct vtfs_ram_block* block = xa_untag_pointer(entry);
+  struct page* page = alloc_page(GFP_HIGHUSER | __GFP_ACCOUNT);
+  if (!page) {
+    return ERR_PTR(-ENOMEM);
+  }
+
+  struct page* src = vtfs_block_get_page(inode->fs, block);
+  if (IS_ERR(src)) {
+    __free_page(page);
+    return src;
+  }
+  copy_highpage(page, src);
+  put_page(src);
+  SetPageReferenced(page);
+
+  // the entry already exists, so this never allocates
+  xa_store(&inode->pages, index, page, GFP_NOWAIT);
+  vtfs_put_block(inode->fs, block);
+  atomic64_inc(&inode->fs->stats.cow_copies);
+  return page;
+}
+
+static struct page* vtfs_get_page_for_write(struct vtfs_inode_payload* inode, pgoff_t index) {
+  struct vtfs_ram_fs* fs = inode->fs;
+  struct page* page = vtfs_load_page_for_write(inode, index);
+  if (page) {
+    return page;
+  }
+
+  if (!vtfs_charge(&fs->used_blocks, fs->max_blocks, 1)) {
+    return ERR_PTR(-ENOSPC);
+  }
+
+  page = alloc_page(GFP_HIGHUSER | __GFP_ZERO | __GFP_ACCOUNT);
+  if (!page) {
+    percpu_counter_dec(&fs->used_blocks);
+    return ERR_PTR(-ENOMEM);
+  }
+  SetPageReferenced(page);
+
+  int err = xa_err(xa_store(&inode->pages, index, page, GFP_KERNEL_ACCOUNT));
+  if (err) {
+    __free_page(page);
+    percpu_counter_dec(&fs->used_blocks);
+    return ERR_PTR(err);
+  }
+  return page;
+}
+
+// the rwsem is dropped around each copy, a fault on a user buffer may need it
+INDIRECT_CALLABLE_SCOPE ssize_t vtfs_ram_read_iter(
+    struct super_block* sb, vtfs_ino_t ino, loff_t offset, struct iov_iter* to
+) {
+  int err;
+  struct vtfs_inode_payload* inode = vtfs_grab_file(VTFS_RAM(sb), ino, &err);
+  if (!inode) {
+    return err;
+  }
+
+  size_t done = 0;
+  ssize_t ret = 0;
+  while (iov_iter_count(to)) {
+    loff_t pos = offset + done;
+    struct page* page = NULL;
+
+    down_read(&inode->rwsem);
+    loff_t size = inode->size;
+    if (pos < size) {
+      page = vtfs_get_read_page(inode, pos >> PAGE_SHIFT);
+    }
+    up_read(&inode->rwsem);
+    if (pos >= size) {
+      break;
+    }
+    if (IS_ERR(page)) {
+      ret = PTR_ERR(page);
+      break;
+    }
+
+    size_t chunk = min_t(size_t, iov_iter_count(to), PAGE_SIZE - offset_in_page(pos));
+    chunk = min_t(loff_t, chunk, size - pos);
+    size_t copied;
+    if (page) {
+      copied = copy_page_to_iter(page, offset_in_page(pos), chunk, to);
+      put_page(page);
+    } else {
+      copied = iov_iter_zero(chunk, to);
+    }
+    done += copied;
+    if (copied < chunk) {
+      ret = -EFAULT;
+      break;
+    }
+  }
+
+  vtfs_put_payload(inode);
+  return done ? (ssize_t)done : ret;
+}
+
+static ssize_t vtfs_ram_read_file(
+    struct super_block* sb, vtfs_ino_t ino, loff_t offset, size_t len, char* dst
+) {
+  struct kvec kv = {.iov_base = dst, .iov_len = len};
+  struct iov_iter iter;
+  iov_iter_kvec(&iter, ITER_DEST, &kv, 1, len);
+  return vtfs_ram_read_iter(sb, ino, offset, &iter);
+}
+
+static ssize_t vtfs_ram_splice_read(
+    struct super_block* sb, vtfs_ino_t ino, loff_t* ppos, struct pipe_inode_info* pipe, size_t len
+) {
+  int err;
+  struct vtfs_inode_payload* inode = vtfs_grab_file(VTFS_RAM(sb), ino, &err);
+  if (!inode) {
+    return err;
+  }
+
+  size_t done = 0;
+  ssize_t ret = 0;
+  while (done < len && !pipe_is_full(pipe)) {
+    loff_t pos = *ppos;
+    struct page* page = NULL;
+
+    down_read(&inode->rwsem);
+    loff_t size = inode->size;
+    if (pos < size) {
+      page = vtfs_get_read_page(inode, pos >> PAGE_SHIFT);
+    }
+    up_read(&inode->rwsem);
+    if (pos >= size) {
+      break;
+    }
+    if (IS_ERR(page)) {
+      ret = PTR_ERR(page);
+      break;
+    }
+    if (!page) {
+      page = ZERO_PAGE(0);
+      get_page(page);
+    }
+
+    // the pipe keeps its own reference; a later write to a private page shows through, as it
+    // would for a page cache page
+    size_t chunk = min_t(size_t, len - done, PAGE_SIZE - offset_in_page(pos));
+    struct pipe_buffer buf = {
+        .page = page,
+        .offset = offset_in_page(pos),
+        .len = min_t(loff_t, chunk, size - pos),
+        .ops = &nosteal_pipe_buf_ops,
+    };
+    ret = add_to_pipe(pipe, &buf);
+    if (ret < 0) {
+      break;
+    }
+    *ppos += ret;
+    done += ret;
+  }
+
+  vtfs_put_payload(inode);
+  return done ? (ssize_t)done : ret;
+}
+
+// copies straight from the iterator into the file's pages, with page faults disabled since a
+// fault on a mapping of this file would need the locks held here. User memory is faulted in
+// before each round, the kernel iterators writeback passes can't fault. A round takes the locks
+// once and is logged as one record.
+INDIRECT_CALLABLE_SCOPE ssize_t vtfs_ram_write_iter(
+    struct super_block* sb, vtfs_ino_t ino, loff_t offset, struct iov_iter* from, loff_t* new_size
+) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  int err;
+  struct vtfs_inode_payload* inode = vtfs_grab_file(fs, ino, &err);
+  if (!inode) {
+    return err;
+  }
+
+  // the pages a round wrote, their data goes into its log record
+  struct bio_vec* bv = NULL;
+  if (fs->wal_file) {
+    bv = kmalloc_array(VTFS_WAL_DATA_MAX / PAGE_SIZE + 1, sizeof(*bv), GFP_KERNEL);
+    if (!bv) {
+      vtfs_put_payload(inode);
+      return -ENOMEM;
+    }
+  }
+
+  size_t done = 0;
+  ssize_t ret = 0;
+  while (iov_iter_count(from) && !ret) {
+    size_t round = min_t(size_t, iov_iter_count(from), VTFS_WAL_DATA_MAX);
+    if (fault_in_iov_iter_readable(from, round) == round) {
+      ret = -EFAULT;
+      break;
+    }
+    if (fatal_signal_pending(current)) {
+      ret = -EINTR;
+      break;
+    }
+
+    percpu_down_read(&fs->quiesce);
+    down_write(&inode->rwsem);
+
+    // bytes past size are always zero, so a gap before offset is left as a hole
+    size_t n = 0;
+    unsigned int nr = 0;
+    while (n < round) {
+      loff_t pos = offset + done + n;
+      size_t page_off = offset_in_page(pos);
+      size_t chunk = min_t(size_t, PAGE_SIZE - page_off, round - n);
+
+      struct page* page = vtfs_get_page_for_write(inode, pos >> PAGE_SHIFT);
+      if (IS_ERR(page)) {
+        ret = PTR_ERR(page);
+        break;
+      }
+      size_t copied = copy_page_from_iter_atomic(page, page_off, chunk, from);
+      if (bv && copied) {
+        bvec_set_page(&bv[nr++], page, copied, page_off);
+      }
+      n += copied;
+      if (copied < chunk) {
+        break;  // paged out again since the fault-in, the next round retries
+      }
+    }
+
+    if (n) {
+      WRITE_ONCE(inode->size, max_t(loff_t, inode->size, offset + done + n));
+      if (bv) {
+        struct iov_iter data;
+        iov_iter_bvec(&data, ITER_SOURCE, bv, nr, n);
+        vtfs_wal_log_write(inode, offset + done, &data);
+      }
+    }
+    if (new_size) {
+      *new_size = inode->size;
+    }
+
+    up_write(&inode->rwsem);
+    percpu_up_read(&fs->quiesce);
+    done += n;
+  }
+
+  kfree(bv);
+  vtfs_put_payload(inode);
+  return done ? (ssize_t)done : ret;
+}
+
+static ssize_t vtfs_ram_write_file(
+    struct super_block* sb,
+    vtfs_ino_t ino,
+    loff_t offset,
+    const char* src,
+    size_t len,
+    loff_t* new_size
+) {
+  struct kvec kv = {.iov_base = (void*)src, .iov_len = len};
+  struct iov_iter iter;
+  iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, len);
+  return vtfs_ram_write_iter(sb, ino, offset, &iter, new_size);
+}
+
+static int vtfs_ram_truncate(struct super_block* sb, vtfs_ino_t ino, loff_t size) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  int err;
+  struct vtfs_inode_payload* inode = vtfs_grab_file(fs, ino, &err);
+  if (!inode) {
+    return err;
+  }
+
+  percpu_down_read(&fs->quiesce);
+  down_write(&inode->rwsem);
+
+  err = 0;
+  if (size < inode->size) {
+    // keep the tail of the last page zeroed so that growing the file again reads zeroes
+    size_t tail = offset_in_page(size);
+    if (tail) {
+      struct page* page = vtfs_load_page_for_write(inode, size >> PAGE_SHIFT);
+      if (IS_ERR(page)) {
+        err = PTR_ERR(page);
+        goto out;
+      }
+      if (page) {
+        memzero_page(page, tail, PAGE_SIZE - tail);
+      }
+    }
+
+    vtfs_free_pages(inode, DIV_ROUND_UP(size, PAGE_SIZE));
+  }
+
+  WRITE_ONCE(inode->size, size);
+
+  struct vtfs_wal_record rec = {.pos = cpu_to_le64(size)};
+  vtfs_wal_log_inode(inode, &rec, VTFS_WAL_TRUNCATE, NULL);
+out:
+  up_write(&inode->rwsem);
+  percpu_up_read(&fs->quiesce);
+  vtfs_put_payload(inode);
+  return err;
+}
+
+// takes the rwsems of both files for writing, in ino order
+static void vtfs_lock_pair(struct vtfs_inode_payload* a, struct vtfs_inode_payload* b) {
+  if (a == b) {
+    down_write(&a->rwsem);
+    return;
+  }
+  if (a->ino > b->ino) {
+    swap(a, b);
+  }
+  down_write(&a->rwsem);
+  down_write_nested(&b->rwsem, SINGLE_DEPTH_NESTING);
+}
+
+static void vtfs_unlock_pair(struct vtfs_inode_payload* a, struct vtfs_inode_payload* b) {
+  if (a != b) {
+    up_write(&b->rwsem);
+  }
+  up_write(&a->rwsem);
+}
+
+// points dst's page at dst_index to the same block as src's page at src_index
+static int vtfs_share_page(
+    struct vtfs_inode_payload* src,
+    pgoff_t src_index,
+    struct vtfs_inode_payload* dst,
+    pgoff_t dst_index
+) {
+  struct vtfs_ram_fs* fs = dst->fs;
+  void* entry = vtfs_load_entry(src, src_index);
+  if (IS_ERR(entry)) {
+    return PTR_ERR(entry);
+  }
+  if (!entry) {
+    entry = xa_erase(&dst->pages, dst_index);
+    if (entry) {
+      vtfs_free_entry(fs, entry);
+    }
+    return 0;
+  }
+
+  struct vtfs_ram_block* block = vtfs_is_block(entry)
+                                     ? xa_untag_pointer(entry)
+                                     : vtfs_freeze_page(src, src_index, entry, false, true);
+  if (!block) {
+    return -ENOMEM;
+  }
+
+  bool charged = !xa_load(&dst->pages, dst_index);
+  if (charged && !vtfs_charge(&fs->used_blocks, fs->max_blocks, 1)) {
+    return -ENOSPC;
+  }
+
+  refcount_inc(&block->ref);
+  atomic64_inc(&fs->stats.dedup_saved);
+  void* old = xa_store(
+      &dst->pages, dst_index, xa_tag_pointer(block, VTFS_ENTRY_BLOCK), GFP_KERNEL_ACCOUNT
+  );
+  if (xa_is_err(old)) {
+    vtfs_put_block(fs, block);
+    if (charged) {
+      percpu_counter_dec(&fs->used_blocks);
+    }
+    return xa_err(old);
+  }
+  // an entry was only there if the slot wasn't charged above
+  if (old) {
+    vtfs_drop_entry(fs, old);
+  }
+  return 0;
+}
+
+// copies the bytes at src_pos into dst_pos, both within a single page
+static int vtfs_copy_bytes(
+    struct vtfs_inode_payload* src,
+    loff_t src_pos,
+    struct vtfs_inode_payload* dst,
+    loff_t dst_pos,
+    size_t len
+) {
+  struct page* from = vtfs_get_read_page(src, src_pos >> PAGE_SHIFT);
+  if (IS_ERR(from)) {
+    return PTR_ERR(from);
+  }
+  if (!from && !xa_load(&dst->pages, dst_pos >> PAGE_SHIFT)) {
+    return 0;  // a hole onto a hole
+  }
+
+  struct page* to = vtfs_get_page_for_write(dst, dst_pos >> PAGE_SHIFT);
+  if (IS_ERR(to)) {
+    if (from) {
+      put_page(from);
+    }
+    return PTR_ERR(to);
+  }
+
+  if (from) {
+    memcpy_page(to, offset_in_page(dst_pos), from, offset_in_page(src_pos), len);
+    put_page(from);
+  } else {
+    memzero_page(to, offset_in_page(dst_pos), len);
+  }
+  return 0;
+}
+
+// logs a copy into dst; one from a file that is already unlinked is logged as the data it left
+static void vtfs_wal_log_copy(
+    struct vtfs_inode_payload* src,
+    loff_t src_off,
+    struct vtfs_inode_payload* dst,
+    loff_t dst_off,
+    size_t len
+) {
+  struct vtfs_ram_fs* fs = dst->fs;
+  if (!fs->wal_file || !dst->nlink) {
+    return;
+  }
+
+  if (src->nlink) {
+    struct vtfs_wal_record rec = {
+        .parent_ino = cpu_to_le64(src->ino),
+        .pos = cpu_to_le64(dst_off),
+        .src_pos = cpu_to_le64(src_off),
+        .count = cpu_to_le64(len),
+    };
+    vtfs_wal_log_inode(dst, &rec, VTFS_WAL_COPY, NULL);
+    return;
+  }
+
+  char* buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+  if (!buf) {
+    mutex_lock(&fs->wal_lock);
+    vtfs_wal_fail(fs, -ENOMEM);
+    mutex_unlock(&fs->wal_lock);
+    return;
+  }
+  for (size_t done = 0; done < len;) {
+    loff_t pos = dst_off + done;
+    size_t chunk = min_t(size_t, PAGE_SIZE - offset_in_page(pos), len - done);
+    int err = vtfs_read_page(dst, pos >> PAGE_SHIFT, offset_in_page(pos), chunk, buf);
+    if (err) {
+      mutex_lock(&fs->wal_lock);
+      vtfs_wal_fail(fs, err);
+      mutex_unlock(&fs->wal_lock);
+      break;
+    }
+    struct kvec kv = {.iov_base = buf, .iov_len = chunk};
+    struct iov_iter data;
+    iov_iter_kvec(&data, ITER_SOURCE, &kv, 1, chunk);
+    vtfs_wal_log_write(dst, pos, &data);
+    done += chunk;
+  }
+  kfree(buf);
+}
+
+static ssize_t vtfs_ram_copy_range(
+    struct super_block* sb,
+    vtfs_ino_t src_ino,
+    loff_t src_off,
+    vtfs_ino_t dst_ino,
+    loff_t dst_off,
+    size_t len,
+    loff_t* new_size
+) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  int err;
+  struct vtfs_inode_payload* src = vtfs_grab_file(fs, src_ino, &err);
+  if (!src) {
+    return err;
+  }
+  struct vtfs_inode_payload* dst = vtfs_grab_file(fs, dst_ino, &err);
+  if (!dst) {
+    vtfs_put_payload(src);
+    return err;
+  }
+
+  percpu_down_read(&fs->quiesce);
+  vtfs_lock_pair(src, dst);
+
+  len = src_off < src->size ? min_t(u64, len, src->size - src_off) : 0;
+  size_t done = 0;
+  err = 0;
+  while (done < len) {
+    loff_t src_pos = src_off + done;
+    loff_t dst_pos = dst_off + done;
+    size_t left = len - done;
+    size_t chunk;
+
+    // a whole page is shared when both sides are aligned; a partial page only when it is the
+    // tail of src and nothing in dst follows it, since bytes past EOF are kept zeroed
+    bool aligned = !offset_in_page(src_pos) && !offset_in_page(dst_pos);
+    if (aligned && (left >= PAGE_SIZE || dst_pos + left >= dst->size)) {
+      chunk = min_t(size_t, left, PAGE_SIZE);
+      err = vtfs_share_page(src, src_pos >> PAGE_SHIFT, dst, dst_pos >> PAGE_SHIFT);
+    } else {
+      chunk = min3(left, PAGE_SIZE - offset_in_page(src_pos), PAGE_SIZE - offset_in_page(dst_pos));
+      err = vtfs_copy_bytes(src, src_pos, dst, dst_pos, chunk);
+    }
+    if (err) {
+      break;
+    }
+    done += chunk;
+    cond_resched();
+  }
+
+  if (done > 0) {
+    WRITE_ONCE(dst->size, max_t(loff_t, dst->size, dst_off + done));
+    vtfs_wal_log_copy(src, src_off, dst, dst_off, done);
+  }
+  if (new_size) {
+    *new_size = dst->size;
+  }
+
+  vtfs_unlock_pair(src, dst);
+  percpu_up_read(&fs->quiesce);
+  vtfs_put_payload(dst);
+  vtfs_put_payload(src);
+  return done ? (ssize_t)done : err;
+}
+
+static int vtfs_ram_chmod(struct super_block* sb, vtfs_ino_t ino, umode_t mode) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  struct vtfs_inode_payload* inode = vtfs_grab_payload(fs, ino);
+  if (!inode) {
+    return -ENOENT;
+  }
+
+  percpu_down_read(&fs->quiesce);
+  down_write(&inode->rwsem);
+  WRITE_ONCE(inode->mode, (inode->mode & S_IFMT) | (mode & 0777));
+
+  struct vtfs_wal_record rec = {.mode = cpu_to_le32(inode->mode)};
+  vtfs_wal_log_inode(inode, &rec, VTFS_WAL_CHMOD, NULL);
+  up_write(&inode->rwsem);
+  percpu_up_read(&fs->quiesce);
+  vtfs_put_payload(inode);
+  return 0;
+}
+
+static int vtfs_ram_seek_data(
+    struct super_block* sb, vtfs_ino_t ino, loff_t offset, int whence, loff_t* out
+) {
+  int err;
+  struct vtfs_inode_payload* inode = vtfs_grab_file(VTFS_RAM(sb), ino, &err);
+  if (!inode) {
+    return err;
+  }
+
+  down_read(&inode->rwsem);
+
+  loff_t size = inode->size;
+  unsigned long index = offset >> PAGE_SHIFT;
+  err = 0;
+
+  if (offset >= size) {
+    err = -ENXIO;
+    goto out;
+  }
+
+  if (whence == SEEK_DATA) {
+    if (!xa_find(&inode->pages, &index, ULONG_MAX, XA_PRESENT)) {
+      err = -ENXIO;
+      goto out;
+    }
+  } else {
+    while (xa_load(&inode->pages, index)) {
+      index++;
+    }
+  }
+
+  loff_t pos = max_t(loff_t, offset, (loff_t)index << PAGE_SHIFT);
+  if (pos >= size) {
+    if (whence == SEEK_DATA) {
+      err = -ENXIO;
+      goto out;
+    }
+    pos = size;  // the virtual hole at EOF
+  }
+  *out = pos;
+
+out:
+  up_read(&inode->rwsem);
+  vtfs_put_payload(inode);
+  return err;
+}
+
+// applies one log record through the same calls that made the change
+static int vtfs_wal_apply(struct super_block* sb, const struct vtfs_wal_record* rec, size_t len) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  size_t name_len = le16_to_cpu(rec->name_len);
+  if (name_len > NAME_MAX || name_len > len - sizeof(*rec)) {
+    return -EUCLEAN;
+  }
+
+  char name[NAME_MAX + 1];
+  memcpy(name, rec + 1, name_len);
+  name[name_len] = '\0';
+  const char* data = (const char*)(rec + 1) + name_len;
+  size_t data_len = len - sizeof(*rec) - name_len;
+
+  u16 op = le16_to_cpu(rec->op);
+  bool named = op >= VTFS_WAL_CREATE && op <= VTFS_WAL_LINK;
+  if (named != (name_len > 0) || strnlen(name, name_len) != name_len || strchr(name, '/')) {
+    return -EUCLEAN;
+  }
+
+  vtfs_ino_t ino = le64_to_cpu(rec->ino);
+  vtfs_ino_t parent = le64_to_cpu(rec->parent_ino);
+  u64 pos = le64_to_cpu(rec->pos);
+  u64 src_pos = le64_to_cpu(rec->src_pos);
+  u64 count = le64_to_cpu(rec->count);
+  umode_t mode = le32_to_cpu(rec->mode) & 0777;
+  if (!ino || ino > U32_MAX || pos > MAX_LFS_FILESIZE || src_pos > MAX_LFS_FILESIZE) {
+    return -EUCLEAN;
+  }
+
+  struct vtfs_node_meta meta;
+  ssize_t n;
+  switch (op) {
+    case VTFS_WAL_CREATE:
+      return vtfs_create_node(fs, parent, name, VTFS_NODE_FILE, S_IFREG | mode, ino, &meta);
+    case VTFS_WAL_MKDIR:
+      return vtfs_create_node(fs, parent, name, VTFS_NODE_DIR, S_IFDIR | mode, ino, &meta);
+    case VTFS_WAL_UNLINK:
+    case VTFS_WAL_RMDIR: {
+      int err = op == VTFS_WAL_UNLINK ? vtfs_ram_unlink(sb, parent, name)
+                                      : vtfs_ram_rmdir(sb, parent, name);
+      // no VFS inode holds on to the ino during replay
+      if (!err) {
+        vtfs_forget_payload(fs, ino);
+      }
+      return err;
+    }
+    case VTFS_WAL_LINK:
+      return vtfs_ram_link(sb, parent, name, ino, &meta);
+    case VTFS_WAL_TRUNCATE:
+      return vtfs_ram_truncate(sb, ino, pos);
+    case VTFS_WAL_CHMOD:
+      return vtfs_ram_chmod(sb, ino, mode);
+    case VTFS_WAL_WRITE:
+      n = vtfs_ram_write_file(sb, ino, pos, data, data_len, NULL);
+      count = data_len;
+      break;
+    case VTFS_WAL_COPY:
+      n = vtfs_ram_copy_range(sb, parent, src_pos, ino, pos, count, NULL);
+      break;
+    default:
+      return -EUCLEAN;
+  }
+  if (n < 0) {
+    return n;
+  }
+  return n == count ? 0 : -EUCLEAN;
+}
+
+// applies the records the restored image doesn't include yet; *end is set past the last good
+// record, anything after it is a batch that was being written when the system went down
+static int vtfs_wal_replay(struct super_block* sb, struct file* file, loff_t* end) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  loff_t size = i_size_read(file_inode(file));
+  loff_t pos = 0;
+  char* buf = NULL;
+  size_t cap = 0;
+  u64 applied = 0;
+  int err = 0;
+
+  while (size - pos >= (loff_t)sizeof(struct vtfs_wal_record)) {
+    struct vtfs_wal_record rec;
+    err = vtfs_image_read(file, &rec, sizeof(rec), pos);
+    if (err) {
+      break;
+    }
+
+    u32 len = le32_to_cpu(rec.len);
+    if (len < sizeof(rec) || len > size - pos) {
+      break;
+    }
+    if (len > cap) {
+      kvfree(buf);
+      buf = kvmalloc(len, GFP_KERNEL);
+      if (!buf) {
+        err = -ENOMEM;
+        break;
+      }
+      cap = len;
+    }
+    err = vtfs_image_read(file, buf, len, pos);
+    if (err) {
+      break;
+    }
+    if (le32_to_cpu(rec.crc) != crc32_le(~0, buf + sizeof(rec.crc), len - sizeof(rec.crc))) {
+      break;
+    }
+
+    u64 seq = le64_to_cpu(rec.seq);
+    if (seq > fs->wal_seq) {
+      if (seq != fs->wal_seq + 1) {
+        LOG("wal: record %llu follows %llu\n", seq, fs->wal_seq);
+        err = -EUCLEAN;
+        break;
+      }
+      err = vtfs_wal_apply(sb, (const struct vtfs_wal_record*)buf, len);
+      if (err) {
+        LOG("wal: replaying record %llu failed: %d\n", seq, err);
+        break;
+      }
+      fs->wal_seq = seq;
+      applied++;
+    }
+    pos += len;
+    cond_resched();
+  }
+
+  kvfree(buf);
+  LOG("wal: replayed %llu records, up to %llu\n", applied, fs->wal_seq);
+  *end = pos;
+  return err;
+}
+
+// replays the log on top of the restored image and opens it for appending
+static int vtfs_wal_open(struct super_block* sb) {
+  struct vtfs_ram_fs* fs = VTFS_RAM(sb);
+  struct file* file = filp_open(fs->wal_path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+  if (IS_ERR(file)) {
+    return PTR_ERR(file);
+  }
+
+  loff_t end;
+  int err = vtfs_wal_replay(sb, file, &end);
+  if (!err && end < i_size_read(file_inode(file))) {
+    // new records must follow the last good one directly
+    LOG("wal: dropping a torn tail at %lld\n", end);
+    err = vfs_truncate(&file->f_path, end);
+  }
+  if (err) {
+    fput(file);
+    return err;
+  }
+
+  // both batches are allocated up front, logging never grows them under wal_lock
+  fs->wal_buf = kvmalloc(VTFS_WAL_BATCH_MAX, GFP_KERNEL);
+  fs->wal_spare = kvmalloc(VTFS_WAL_BATCH_MAX, GFP_KERNEL);
+  if (!fs->wal_buf || !fs->wal_spare) {
+    fput(file);
+    return -ENOMEM;
+  }
+
+  fs->wal_size = end;
+  fs->wal_synced_seq = fs->wal_seq;
+  fs->wal_file = file;
+  return 0;
+}
+
+const struct vtfs_backend_ops vtfs_ram_backend_ops = {
+    .name = "ram",
+    .flags = VTFS_STORAGE_NOCACHE,
+    .init = vtfs_ram_init,
+    .shutdown = vtfs_ram_shutdown,
+    .fill_super = vtfs_ram_fill_super,
+    .kill_sb = vtfs_ram_kill_sb,
+    .evict = vtfs_ram_evict,
+    .configure = vtfs_ram_configure,
+    .statfs = vtfs_ram_statfs,
+    .get_root = vtfs_ram_get_root,
+    .lookup = vtfs_ram_lookup,
+    .iterate_dir = vtfs_ram_iterate_dir,
+    .iterate_dir_plus = vtfs_ram_iterate_dir_plus,
+    .create_file = vtfs_ram_create_file,
+    .unlink = vtfs_ram_unlink,
+    .mkdir = vtfs_ram_mkdir,
+    .rmdir = vtfs_ram_rmdir,
+    .read_file = vtfs_ram_read_file,
+    .write_file = vtfs_ram_write_file,
+    .read_iter = vtfs_ram_read_iter,
+    .write_iter = vtfs_ram_write_iter,
+    .splice_read = vtfs_ram_splice_read,
+    .link = vtfs_ram_link,
+    .truncate = vtfs_ram_truncate,
+    .copy_range = vtfs_ram_copy_range,
+    .chmod = vtfs_ram_chmod,
+    .checkpoint = vtfs_ram_checkpoint,
+    .sync = vtfs_ram_sync,
+    .seek_data = vtfs_ram_seek_data,
+};
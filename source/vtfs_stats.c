@@ -0,0 +1,109 @@
+#include "vtfs_stats.h"
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+static const char* const vtfs_stat_op_names[VTFS_OP_NR] = {
+    [VTFS_OP_GET_ROOT] = "get_root",
+    [VTFS_OP_LOOKUP] = "lookup",
+    [VTFS_OP_ITERATE_DIR] = "iterate_dir",
+    [VTFS_OP_CREATE] = "create",
+    [VTFS_OP_UNLINK] = "unlink",
+    [VTFS_OP_MKDIR] = "mkdir",
+    [VTFS_OP_RMDIR] = "rmdir",
+    [VTFS_OP_LINK] = "link",
+    [VTFS_OP_READ] = "read",
+    [VTFS_OP_WRITE] = "write",
+    [VTFS_OP_SPLICE_READ] = "splice_read",
+    [VTFS_OP_TRUNCATE] = "truncate",
+    [VTFS_OP_CHMOD] = "chmod",
+    [VTFS_OP_COPY_RANGE] = "copy_range",
+    [VTFS_OP_SEEK_DATA] = "seek_data",
+    [VTFS_OP_SYNC] = "sync",
+    [VTFS_OP_HTTP_CONNECT] = "http_connect",
+    [VTFS_OP_HTTP_SEND] = "http_send",
+    [VTFS_OP_HTTP_RECV] = "http_recv",
+    [VTFS_OP_HTTP_PARSE] = "http_parse",
+};
+
+static const char* const vtfs_stat_counter_names[VTFS_CNT_NR] = {
+    [VTFS_CNT_READ_BYTES] = "read_bytes",
+    [VTFS_CNT_WRITE_BYTES] = "write_bytes",
+    [VTFS_CNT_BACKEND_READ_BYTES] = "backend_read_bytes",
+    [VTFS_CNT_BACKEND_WRITE_BYTES] = "backend_write_bytes",
+    [VTFS_CNT_DENTRY_HITS] = "dentry_hits",
+    [VTFS_CNT_DENTRY_MISSES] = "dentry_misses",
+    [VTFS_CNT_ATTR_HITS] = "attr_hits",
+    [VTFS_CNT_ATTR_MISSES] = "attr_misses",
+    [VTFS_CNT_HTTP_SENT_BYTES] = "http_sent_bytes",
+    [VTFS_CNT_HTTP_RECEIVED_BYTES] = "http_received_bytes",
+    [VTFS_CNT_HTTP_POOL_HITS] = "http_pool_hits",
+};
+
+struct vtfs_stats __percpu* vtfs_stats_alloc(void) {
+  return alloc_percpu(struct vtfs_stats);
+}
+
+void vtfs_stats_free(struct vtfs_stats __percpu* stats) {
+  free_percpu(stats);
+}
+
+// counters are summed over the CPUs without stopping the writers, a reading may be a few
+// updates behind
+static int vtfs_stats_show(struct seq_file* m, void* v) {
+  struct vtfs_stats __percpu* stats = (struct vtfs_stats __percpu __force*)m->private;
+  struct vtfs_stats* sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+  if (!sum)
+    return -ENOMEM;
+
+  int cpu;
+  for_each_possible_cpu(cpu) {
+    struct vtfs_stats* s = per_cpu_ptr(stats, cpu);
+    for (int op = 0; op < VTFS_OP_NR; op++) {
+      sum->ops[op].count += READ_ONCE(s->ops[op].count);
+      sum->ops[op].errors += READ_ONCE(s->ops[op].errors);
+      sum->ops[op].total_ns += READ_ONCE(s->ops[op].total_ns);
+      for (int b = 0; b < VTFS_STAT_BUCKETS; b++)
+        sum->ops[op].hist[b] += READ_ONCE(s->ops[op].hist[b]);
+    }
+    for (int c = 0; c < VTFS_CNT_NR; c++)
+      sum->counters[c] += READ_ONCE(s->counters[c]);
+  }
+
+  for (int c = 0; c < VTFS_CNT_NR; c++)
+    seq_printf(m, "%s: %llu\n", vtfs_stat_counter_names[c], sum->counters[c]);
+
+  // one line per op that ran: count, errors, total time, then the non-empty buckets as
+  // <lower bound in ns>:<count>
+  for (int op = 0; op < VTFS_OP_NR; op++) {
+    struct vtfs_op_stat* s = &sum->ops[op];
+    if (!s->count)
+      continue;
+
+    seq_printf(
+        m,
+        "%s: count %llu errors %llu total_ns %llu",
+        vtfs_stat_op_names[op],
+        s->count,
+        s->errors,
+        s->total_ns
+    );
+    for (int b = 0; b < VTFS_STAT_BUCKETS; b++) {
+      if (s->hist[b])
+        seq_printf(m, " %llu:%llu", b ? 1ULL << b : 0, s->hist[b]);
+    }
+    seq_putc(m, '\n');
+  }
+
+  kfree(sum);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vtfs_stats);
+
+struct dentry* vtfs_stats_create_file(
+    const char* name, struct dentry* parent, struct vtfs_stats __percpu* stats
+) {
+  return debugfs_create_file(name, 0444, parent, (void __force*)stats, &vtfs_stats_fops);
+}
@@ -0,0 +1,103 @@
+#ifndef _VTFS_STATS_H
+#define _VTFS_STATS_H
+
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+
+struct dentry;
+
+// backend calls and lavnetfs HTTP phases, each with a latency histogram
+enum vtfs_stat_op {
+  VTFS_OP_GET_ROOT,
+  VTFS_OP_LOOKUP,
+  VTFS_OP_ITERATE_DIR,
+  VTFS_OP_CREATE,
+  VTFS_OP_UNLINK,
+  VTFS_OP_MKDIR,
+  VTFS_OP_RMDIR,
+  VTFS_OP_LINK,
+  VTFS_OP_READ,
+  VTFS_OP_WRITE,
+  VTFS_OP_SPLICE_READ,
+  VTFS_OP_TRUNCATE,
+  VTFS_OP_CHMOD,
+  VTFS_OP_COPY_RANGE,
+  VTFS_OP_SEEK_DATA,
+  VTFS_OP_SYNC,
+  VTFS_OP_HTTP_CONNECT,
+  VTFS_OP_HTTP_SEND,
+  VTFS_OP_HTTP_RECV,
+  VTFS_OP_HTTP_PARSE,
+  VTFS_OP_NR,
+};
+
+enum vtfs_stat_counter {
+  VTFS_CNT_READ_BYTES,  // returned by read_iter, from the page cache or not
+  VTFS_CNT_WRITE_BYTES,
+  VTFS_CNT_BACKEND_READ_BYTES,
+  VTFS_CNT_BACKEND_WRITE_BYTES,
+  VTFS_CNT_DENTRY_HITS,  // dentries of a remote backend still within their lifetime
+  VTFS_CNT_DENTRY_MISSES,
+  VTFS_CNT_ATTR_HITS,
+  VTFS_CNT_ATTR_MISSES,
+  VTFS_CNT_HTTP_SENT_BYTES,
+  VTFS_CNT_HTTP_RECEIVED_BYTES,
+  VTFS_CNT_HTTP_POOL_HITS,  // requests sent over a kept-alive connection
+  VTFS_CNT_NR,
+};
+
+// bucket i counts latencies in [2^i, 2^(i+1)) ns, the last one everything slower
+#define VTFS_STAT_BUCKETS 36
+
+struct vtfs_op_stat {
+  u64 count;
+  u64 errors;
+  u64 total_ns;
+  u64 hist[VTFS_STAT_BUCKETS];
+};
+
+// one per CPU, summed when read
+struct vtfs_stats {
+  struct vtfs_op_stat ops[VTFS_OP_NR];
+  u64 counters[VTFS_CNT_NR];
+};
+
+static inline void vtfs_stat_op(
+    struct vtfs_stats __percpu* stats, enum vtfs_stat_op op, u64 start, long ret
+) {
+  u64 ns = ktime_get_ns() - start;
+  unsigned int bucket = min_t(unsigned int, ns ? ilog2(ns) : 0, VTFS_STAT_BUCKETS - 1);
+
+  this_cpu_inc(stats->ops[op].count);
+  if (ret < 0)
+    this_cpu_inc(stats->ops[op].errors);
+  this_cpu_add(stats->ops[op].total_ns, ns);
+  this_cpu_inc(stats->ops[op].hist[bucket]);
+}
+
+static inline void vtfs_stat_add(
+    struct vtfs_stats __percpu* stats, enum vtfs_stat_counter counter, u64 value
+) {
+  this_cpu_add(stats->counters[counter], value);
+}
+
+// times a backend call, evaluates to what it returns
+#define vtfs_stat_call(stats, op, call)                \
+  ({                                                   \
+    u64 __vtfs_start = ktime_get_ns();                 \
+    typeof(call) __vtfs_ret = (call);                  \
+    vtfs_stat_op(stats, op, __vtfs_start, __vtfs_ret); \
+    __vtfs_ret;                                        \
+  })
+
+struct vtfs_stats __percpu* vtfs_stats_alloc(void);
+
+void vtfs_stats_free(struct vtfs_stats __percpu* stats);
+
+// a debugfs file called name under parent that shows stats
+struct dentry* vtfs_stats_create_file(
+    const char* name, struct dentry* parent, struct vtfs_stats __percpu* stats
+);
+
+#endif
@@ -0,0 +1,128 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vtfs
+
+#if !defined(_VTFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VTFS_TRACE_H
+
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+
+// start of a latency reported by an exit event; the clock is only read while the event is on
+#define vtfs_trace_start(event) (trace_##event##_enabled() ? ktime_get_ns() : 0)
+
+// clang-format off
+
+// a VFS operation; name, pos and len are whatever the operation has, NULL and 0 otherwise
+TRACE_EVENT(vtfs_op_enter,
+  TP_PROTO(const char* op, unsigned long ino, const char* name, loff_t pos, size_t len),
+  TP_ARGS(op, ino, name, pos, len),
+
+  TP_STRUCT__entry(
+    __string(op, op)
+    __field(unsigned long, ino)
+    __string(name, name ? name : "")
+    __field(loff_t, pos)
+    __field(size_t, len)
+  ),
+
+  TP_fast_assign(
+    __assign_str(op);
+    __entry->ino = ino;
+    __assign_str(name);
+    __entry->pos = pos;
+    __entry->len = len;
+  ),
+
+  TP_printk("%s ino=%lu name=%s pos=%lld len=%zu",
+            __get_str(op), __entry->ino, __get_str(name), __entry->pos, __entry->len)
+);
+
+// start comes from vtfs_trace_start(vtfs_op_exit), 0 reports no latency
+TRACE_EVENT(vtfs_op_exit,
+  TP_PROTO(const char* op, unsigned long ino, long ret, u64 start),
+  TP_ARGS(op, ino, ret, start),
+
+  TP_STRUCT__entry(
+    __string(op, op)
+    __field(unsigned long, ino)
+    __field(long, ret)
+    __field(u64, latency_ns)
+  ),
+
+  TP_fast_assign(
+    __assign_str(op);
+    __entry->ino = ino;
+    __entry->ret = ret;
+    __entry->latency_ns = start ? ktime_get_ns() - start : 0;
+  ),
+
+  TP_printk("%s ino=%lu ret=%ld latency_ns=%llu",
+            __get_str(op), __entry->ino, __entry->ret, __entry->latency_ns)
+);
+
+// a request to the lavnetfs server
+TRACE_EVENT(vtfs_rpc_enter,
+  TP_PROTO(const char* method, size_t body_len),
+  TP_ARGS(method, body_len),
+
+  TP_STRUCT__entry(
+    __string(method, method)
+    __field(size_t, body_len)
+  ),
+
+  TP_fast_assign(
+    __assign_str(method);
+    __entry->body_len = body_len;
+  ),
+
+  TP_printk("%s body_len=%zu", __get_str(method), __entry->body_len)
+);
+
+// ret is what the vtfs_http_call functions return: 0, the server's error code or a negative
+// transport error
+TRACE_EVENT(vtfs_rpc_exit,
+  TP_PROTO(const char* method, s64 ret, u64 start),
+  TP_ARGS(method, ret, start),
+
+  TP_STRUCT__entry(
+    __string(method, method)
+    __field(s64, ret)
+    __field(u64, latency_ns)
+  ),
+
+  TP_fast_assign(
+    __assign_str(method);
+    __entry->ret = ret;
+    __entry->latency_ns = start ? ktime_get_ns() - start : 0;
+  ),
+
+  TP_printk("%s ret=%lld latency_ns=%llu", __get_str(method), __entry->ret, __entry->latency_ns)
+);
+
+TRACE_EVENT(vtfs_http_response,
+  TP_PROTO(const char* status, int content_length),
+  TP_ARGS(status, content_length),
+
+  TP_STRUCT__entry(
+    __string(status, status)
+    __field(int, content_length)
+  ),
+
+  TP_fast_assign(
+    __assign_str(status);
+    __entry->content_length = content_length;
+  ),
+
+  TP_printk("status=%s content_length=%d", __get_str(status), __entry->content_length)
+);
+
+// clang-format on
+
+#endif
+
+// define_trace.h includes this file again by name, the Makefile puts source/ on the path
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vtfs_trace
+#include <trace/define_trace.h>